@@ -0,0 +1,214 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <gtk/gtk.h>
+#include <glib/gi18n.h>
+#include "raindrop.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+// Rough limits of the display pipeline on each generation of Pi. Pixel clocks are
+// estimated from the mode size and refresh rate, allowing 20% for blanking, which
+// is close to the CEA timings most monitors use.
+
+typedef struct {
+    const char *compatible;     // SoC entry in the device tree compatible list
+    int crtcs;                  // outputs which can be driven at once
+    int max_pclk;               // pixel clock limit for one output, in kHz
+    int total_pclk;             // pixel clock limit for all outputs, in kHz
+} board_t;
+
+static const board_t boards[] = {
+    { "brcm,bcm2712", 3, 600000, 1200000 },
+    { "brcm,bcm2711", 3, 600000, 760000 },
+    { "brcm,bcm2837", 3, 165000, 330000 },
+    { "brcm,bcm2836", 3, 165000, 330000 },
+    { "brcm,bcm2835", 3, 165000, 330000 },
+};
+
+#define BLANKING 1.2
+#define SCANOUT_BUFFERS 3
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+static const board_t *board;
+static long cma_kb;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static const board_t *find_board (void);
+static long find_cma (void);
+static int pixel_clock (monitor_t *mon);
+static long buffer_kb (monitor_t *mon);
+void init_budget (void);
+const char *check_budget (long mon, monitor_t *cand);
+
+/*----------------------------------------------------------------------------*/
+/* Hardware limits */
+/*----------------------------------------------------------------------------*/
+
+static const board_t *find_board (void)
+{
+    char *compat, *ptr;
+    gsize len;
+    int i;
+
+    if (!g_file_get_contents ("/proc/device-tree/compatible", &compat, &len, NULL)) return NULL;
+
+    // the file is a list of NUL-separated strings
+    for (ptr = compat; ptr < compat + len; ptr += strlen (ptr) + 1)
+    {
+        for (i = 0; i < G_N_ELEMENTS (boards); i++)
+        {
+            if (!g_strcmp0 (ptr, boards[i].compatible))
+            {
+                g_free (compat);
+                return &boards[i];
+            }
+        }
+    }
+    g_free (compat);
+    return NULL;
+}
+
+static long find_cma (void)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t len = 0;
+    long kb = 0;
+
+    fp = fopen ("/proc/meminfo", "r");
+    if (fp)
+    {
+        while (getline (&line, &len, fp) != -1)
+            if (sscanf (line, "CmaTotal: %ld kB", &kb) == 1) break;
+        free (line);
+        fclose (fp);
+    }
+    return kb;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Cost of a mode */
+/*----------------------------------------------------------------------------*/
+
+static int pixel_clock (monitor_t *mon)
+{
+    double pclk;
+
+    pclk = mon->width * mon->height * mon->freq * BLANKING / 1000.0;
+    if (mon->interlaced) pclk /= 2;
+    return pclk;
+}
+
+static long buffer_kb (monitor_t *mon)
+{
+    long frame, kb;
+    float multiplier;
+
+    frame = mon->width * mon->height * 4 / 1024;
+    kb = frame * SCANOUT_BUFFERS;
+
+    // fractional scales are rendered at the next integer scale, then scaled down
+    multiplier = ceil (mon->scale) / mon->scale;
+    if (multiplier != 1.0) kb += frame * multiplier * multiplier * 2;
+
+    // the display hardware can't rotate by 90 degrees, so the compositor renders rotated copies
+    if (mon->rotation == 90 || mon->rotation == 270) kb += frame * 2;
+
+    return kb;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Budget checks */
+/*----------------------------------------------------------------------------*/
+
+void init_budget (void)
+{
+    int m;
+
+    board = find_board ();
+    cma_kb = find_cma ();
+
+    // if what is running now doesn't fit, the model is wrong for this system
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL) continue;
+        if (check_budget (m, &mons[m]))
+        {
+            g_message ("Current layout exceeds the display budget - not checking layouts");
+            board = NULL;
+            cma_kb = 0;
+            break;
+        }
+    }
+}
+
+const char *check_budget (long mon, monitor_t *cand)
+{
+    monitor_t *cmon;
+    int m, outputs = 0;
+    long pclk, total_pclk = 0, kb = 0;
+
+    // cand replaces the settings of monitor mon; everything else is as currently set
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL) continue;
+        cmon = m == mon ? cand : &mons[m];
+        if (!cmon->enabled) continue;
+
+        outputs++;
+        pclk = pixel_clock (cmon);
+        if (board && m == mon && pclk > board->max_pclk)
+            return _("This mode needs a higher pixel clock than this output supports");
+        total_pclk += pclk;
+        kb += buffer_kb (cmon);
+    }
+
+    if (board && outputs > board->crtcs)
+        return _("No more displays can be active at the same time");
+    if (board && total_pclk > board->total_pclk)
+        return _("The active displays together need a higher pixel clock than is available");
+
+    // leave at least half of the contiguous memory for applications
+    if (cma_kb && kb > cma_kb / 2)
+        return _("The active displays together need more graphics memory than is available");
+
+    return NULL;
+}
+
+/* End of file */
+/*============================================================================*/
@@ -0,0 +1,421 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include "raindrop.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    gpointer data;
+    GDestroyNotify free_func;
+} cache_entry_t;
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+// contents of each backup when it was taken, keyed by backup filename
+static GHashTable *snapshots;
+
+// parsed contents of input files, keyed by filename
+static GHashTable *cache;
+static GMutex cache_lock;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static char *resolve_path (const char *filename);
+FILE *open_atomic (const char *filename, char **tmpname);
+gboolean close_atomic (FILE *fp, char *tmpname, const char *filename);
+gboolean write_atomic (const char *filename, const char *data, gsize len);
+static char *temp_name (const char *target);
+gboolean copy_file (const char *src, const char *dst);
+gboolean backup_file (const char *filename, const char *backup);
+gboolean restore_file (const char *backup, const char *filename);
+gboolean file_contains (const char *filename, const char *str);
+static char *file_hash (const char *filename);
+static gboolean files_identical (const char *src, const char *dst);
+void install_system_files (const char **files);
+static void free_cache_entry (cache_entry_t *entry);
+gboolean cache_lookup (const char *filename, gpointer *data, GStatBuf *st);
+void cache_store (const char *filename, const GStatBuf *st, gpointer data, GDestroyNotify free_func);
+
+/*----------------------------------------------------------------------------*/
+/* Atomic writes */
+/*----------------------------------------------------------------------------*/
+
+// Config files are written to a temporary file alongside them, synced, then renamed
+// into place. A crash never leaves a partial file, and an existing inode is never
+// modified, so backups can simply be hard links to it.
+
+static char *resolve_path (const char *filename)
+{
+    char *path, *res;
+
+    // write through symlinks rather than replacing them
+    path = realpath (filename, NULL);
+    res = g_strdup (path ? path : filename);
+    free (path);
+    return res;
+}
+
+FILE *open_atomic (const char *filename, char **tmpname)
+{
+    FILE *fp;
+    GStatBuf st;
+    char *target;
+    int fd;
+
+    target = resolve_path (filename);
+    *tmpname = g_strdup_printf ("%s.XXXXXX", target);
+    fd = g_mkstemp (*tmpname);
+    if (fd == -1)
+    {
+        g_free (*tmpname);
+        *tmpname = NULL;
+        g_free (target);
+        return NULL;
+    }
+
+    // keep the permissions of the file being replaced
+    if (!g_stat (target, &st)) fchmod (fd, st.st_mode & 07777);
+    else fchmod (fd, 0644);
+    g_free (target);
+
+    fp = fdopen (fd, "w");
+    if (!fp)
+    {
+        close (fd);
+        g_unlink (*tmpname);
+        g_free (*tmpname);
+        *tmpname = NULL;
+    }
+    return fp;
+}
+
+gboolean close_atomic (FILE *fp, char *tmpname, const char *filename)
+{
+    gboolean res = TRUE;
+    char *target, *dir;
+    int fd;
+
+    if (ferror (fp) || fflush (fp) || fsync (fileno (fp))) res = FALSE;
+    if (fclose (fp)) res = FALSE;
+
+    target = resolve_path (filename);
+    if (res && g_rename (tmpname, target)) res = FALSE;
+    if (!res) g_unlink (tmpname);
+    g_free (tmpname);
+
+    // make the rename itself durable
+    if (res)
+    {
+        dir = g_path_get_dirname (target);
+        fd = open (dir, O_RDONLY | O_DIRECTORY);
+        if (fd != -1)
+        {
+            fsync (fd);
+            close (fd);
+        }
+        g_free (dir);
+    }
+    g_free (target);
+
+    return res;
+}
+
+gboolean write_atomic (const char *filename, const char *data, gsize len)
+{
+    FILE *fp;
+    char *tmpname;
+
+    fp = open_atomic (filename, &tmpname);
+    if (!fp) return FALSE;
+
+    fwrite (data, 1, len, fp);
+    return close_atomic (fp, tmpname, filename);
+}
+
+/*----------------------------------------------------------------------------*/
+/* File helpers - used by the backends in place of shelling out */
+/*----------------------------------------------------------------------------*/
+
+static char *temp_name (const char *target)
+{
+    char *tmpname;
+    int fd;
+
+    // an unpredictable name, created exclusively, as open_atomic does - the
+    // destination may be in a world-writable directory such as /tmp
+    tmpname = g_strdup_printf ("%s.XXXXXX", target);
+    fd = g_mkstemp (tmpname);
+    if (fd == -1)
+    {
+        g_free (tmpname);
+        return NULL;
+    }
+    close (fd);
+    return tmpname;
+}
+
+gboolean copy_file (const char *src, const char *dst)
+{
+    GFile *fsrc, *ftmp;
+    char *target, *tmpname;
+    gboolean res;
+
+    // copy alongside the destination and rename into place, like any other write
+    target = resolve_path (dst);
+    tmpname = temp_name (target);
+    if (!tmpname)
+    {
+        g_free (target);
+        return FALSE;
+    }
+
+    // GIO will reflink rather than copy the data where the filesystem allows it
+    fsrc = g_file_new_for_path (src);
+    ftmp = g_file_new_for_path (tmpname);
+    res = g_file_copy (fsrc, ftmp, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, NULL);
+    g_object_unref (fsrc);
+    g_object_unref (ftmp);
+
+    if (res && g_rename (tmpname, target)) res = FALSE;
+    if (!res) g_unlink (tmpname);
+    g_free (tmpname);
+    g_free (target);
+
+    return res;
+}
+
+gboolean backup_file (const char *filename, const char *backup)
+{
+    char *buf;
+    gsize len;
+
+    // keep the original bytes in memory too, so a revert doesn't depend on the disk copy
+    if (!snapshots) snapshots = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_bytes_unref);
+    if (g_file_get_contents (filename, &buf, &len, NULL))
+        g_hash_table_replace (snapshots, g_strdup (backup), g_bytes_new_take (buf, len));
+    else g_hash_table_remove (snapshots, backup);
+
+    // the file is only ever replaced, never rewritten, so the backup can share its inode
+    g_unlink (backup);
+    if (!linkat (AT_FDCWD, filename, AT_FDCWD, backup, AT_SYMLINK_FOLLOW)) return TRUE;
+
+    // different filesystem, or one without hard links
+    return copy_file (filename, backup);
+}
+
+gboolean restore_file (const char *backup, const char *filename)
+{
+    char *target, *tmpname, *buf;
+    const char *data;
+    GBytes *bytes;
+    gboolean res;
+    gsize len;
+
+    target = resolve_path (filename);
+
+    bytes = snapshots ? g_hash_table_lookup (snapshots, backup) : NULL;
+    if (bytes)
+    {
+        data = g_bytes_get_data (bytes, &len);
+        res = write_atomic (target, data, len);
+    }
+    else
+    {
+        // the link needs a free name - if anything takes it first, the link fails and
+        // the contents are written instead
+        tmpname = temp_name (target);
+        if (tmpname) g_unlink (tmpname);
+        res = tmpname && !linkat (AT_FDCWD, backup, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) && !g_rename (tmpname, target);
+        if (!res)
+        {
+            if (tmpname) g_unlink (tmpname);
+            if (g_file_get_contents (backup, &buf, &len, NULL))
+            {
+                res = write_atomic (target, buf, len);
+                g_free (buf);
+            }
+        }
+        g_free (tmpname);
+    }
+    g_free (target);
+
+    return res;
+}
+
+gboolean file_contains (const char *filename, const char *str)
+{
+    char *buf;
+    gboolean res;
+
+    if (!g_file_get_contents (filename, &buf, NULL, NULL)) return FALSE;
+    res = strstr (buf, str) != NULL;
+    g_free (buf);
+
+    return res;
+}
+
+/*----------------------------------------------------------------------------*/
+/* System config */
+/*----------------------------------------------------------------------------*/
+
+static char *file_hash (const char *filename)
+{
+    char *data, *hash;
+    gsize len;
+
+    if (!g_file_get_contents (filename, &data, &len, NULL)) return NULL;
+    hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) data, len);
+    g_free (data);
+    return hash;
+}
+
+static gboolean files_identical (const char *src, const char *dst)
+{
+    GStatBuf sbuf, dbuf;
+    char *shash, *dhash;
+    gboolean res;
+
+    // differing sizes settle it without reading either file
+    if (g_stat (src, &sbuf) || g_stat (dst, &dbuf)) return FALSE;
+    if (sbuf.st_size != dbuf.st_size) return FALSE;
+
+    shash = file_hash (src);
+    dhash = file_hash (dst);
+    res = shash && dhash && !g_strcmp0 (shash, dhash);
+    g_free (shash);
+    g_free (dhash);
+    return res;
+}
+
+void install_system_files (const char **files)
+{
+    GString *cmd;
+    char *arg;
+    int i, n = 0;
+
+    // files is a NULL-terminated list of source and destination pairs - the helper
+    // installs all of them, so there is only the one sudo call to authorise
+    cmd = g_string_new (SUDO_PREFIX SYSCONF_HELPER);
+    for (i = 0; files[i] && files[i + 1]; i += 2)
+    {
+        // the installed copy already matches - nothing to do for this pair
+        if (files_identical (files[i], files[i + 1])) continue;
+
+        arg = g_shell_quote (files[i]);
+        g_string_append_printf (cmd, " %s", arg);
+        g_free (arg);
+        arg = g_shell_quote (files[i + 1]);
+        g_string_append_printf (cmd, " %s", arg);
+        g_free (arg);
+        n++;
+    }
+
+    // skip sudo, and with it the password prompt, if every file is up to date
+    if (n) system (cmd->str);
+    g_string_free (cmd, TRUE);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Parse cache */
+/*----------------------------------------------------------------------------*/
+
+// Parsed input files are kept for the life of the process, and are only used while
+// the file's device, inode, modification time and size are all unchanged. Files are
+// always replaced rather than rewritten, so any change gives at least a new inode.
+// Each file is only read from one thread, so returned data stays valid until that
+// thread next looks the same file up.
+
+static void free_cache_entry (cache_entry_t *entry)
+{
+    if (entry->free_func) entry->free_func (entry->data);
+    g_free (entry);
+}
+
+gboolean cache_lookup (const char *filename, gpointer *data, GStatBuf *st)
+{
+    cache_entry_t *entry;
+    gboolean res = FALSE;
+
+    // the identity is taken before the caller parses, so a replacement made while it
+    // parses is seen as a change next time, rather than stored against the old data
+    if (g_stat (filename, st)) memset (st, 0, sizeof (GStatBuf));
+
+    g_mutex_lock (&cache_lock);
+    entry = cache ? g_hash_table_lookup (cache, filename) : NULL;
+    if (entry)
+    {
+        if (st->st_ino && st->st_dev == entry->dev && st->st_ino == entry->ino
+            && st->st_mtim.tv_sec == entry->mtime.tv_sec && st->st_mtim.tv_nsec == entry->mtime.tv_nsec
+            && st->st_size == entry->size)
+        {
+            *data = entry->data;
+            res = TRUE;
+        }
+        else g_hash_table_remove (cache, filename);
+    }
+    g_mutex_unlock (&cache_lock);
+    return res;
+}
+
+void cache_store (const char *filename, const GStatBuf *st, gpointer data, GDestroyNotify free_func)
+{
+    cache_entry_t *entry;
+
+    // a file which was missing has a zeroed identity, which never matches, so is dropped next time
+    entry = g_new0 (cache_entry_t, 1);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->size = st->st_size;
+    entry->data = data;
+    entry->free_func = free_func;
+
+    g_mutex_lock (&cache_lock);
+    if (!cache) cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_cache_entry);
+    g_hash_table_replace (cache, g_strdup (filename), entry);
+    g_mutex_unlock (&cache_lock);
+}
+
+/* End of file */
+/*============================================================================*/
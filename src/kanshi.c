@@ -0,0 +1,293 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <gtk/gtk.h>
+#include "raindrop.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+// A kanshi config is held as a list of nodes, each keeping the exact text it was
+// parsed from, so anything not being replaced - comments, includes, global output
+// blocks, other profiles and their options - is written back unchanged.
+
+typedef enum {
+    KANSHI_TEXT,
+    KANSHI_PROFILE
+} kanshi_type_t;
+
+typedef struct {
+    kanshi_type_t type;
+    char *text;
+    char *name;
+    char *key;
+    guint hash;
+} kanshi_node_t;
+
+typedef enum {
+    TOK_EOF,
+    TOK_WORD,
+    TOK_LBRACE,
+    TOK_RBRACE,
+    TOK_NEWLINE
+} token_t;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static token_t next_token (const char **pos, const char *end, char **word);
+static gint sort_names (gconstpointer a, gconstpointer b);
+static char *output_key (GPtrArray *outputs);
+static kanshi_node_t *parse_node (const char **pos, const char *end);
+static void free_node (kanshi_node_t *node);
+static gboolean is_blank (kanshi_node_t *node);
+GList *kanshi_parse (const char *filename);
+void kanshi_free (GList *nodes);
+void kanshi_write (GList *nodes, FILE *fp, const char **outputs);
+
+/*----------------------------------------------------------------------------*/
+/* Parsing */
+/*----------------------------------------------------------------------------*/
+
+// kanshi picks a profile when its outputs are exactly the connected set, so
+// profiles are identified by their sorted output names - order doesn't matter
+
+static gint sort_names (gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0 (*((char **) a), *((char **) b));
+}
+
+static char *output_key (GPtrArray *outputs)
+{
+    g_ptr_array_sort (outputs, (GCompareFunc) sort_names);
+    g_ptr_array_add (outputs, NULL);
+    return g_strjoinv ("\n", (char **) outputs->pdata);
+}
+
+static token_t next_token (const char **pos, const char *end, char **word)
+{
+    const char *p = *pos;
+    GString *str;
+
+    if (word) *word = NULL;
+
+    // skip blanks and comments
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p < end && *p == '#')
+        while (p < end && *p != '\n') p++;
+
+    if (p >= end)
+    {
+        *pos = p;
+        return TOK_EOF;
+    }
+
+    *pos = p + 1;
+    if (*p == '\n') return TOK_NEWLINE;
+    if (*p == '{') return TOK_LBRACE;
+    if (*p == '}') return TOK_RBRACE;
+
+    // a bare word, or a quoted string which may contain spaces
+    str = g_string_new (NULL);
+    if (*p == '"')
+    {
+        p++;
+        while (p < end && *p != '"' && *p != '\n')
+        {
+            if (*p == '\\' && p + 1 < end) p++;
+            g_string_append_c (str, *p++);
+        }
+        if (p < end && *p == '"') p++;
+    }
+    else
+    {
+        while (p < end && !g_ascii_isspace (*p) && *p != '{' && *p != '}' && *p != '#')
+            g_string_append_c (str, *p++);
+    }
+    *pos = p;
+
+    if (word) *word = g_string_free (str, FALSE);
+    else g_string_free (str, TRUE);
+    return TOK_WORD;
+}
+
+static kanshi_node_t *parse_node (const char **pos, const char *end)
+{
+    kanshi_node_t *node;
+    GPtrArray *outputs;
+    const char *start = *pos;
+    token_t tok;
+    char *word;
+    int depth = 0, nword = 0;
+    gboolean opened = FALSE, output = FALSE;
+
+    node = g_new0 (kanshi_node_t, 1);
+    node->type = KANSHI_TEXT;
+    outputs = g_ptr_array_new_with_free_func (g_free);
+
+    // a node runs to the end of the line on which its braces balance
+    do
+    {
+        tok = next_token (pos, end, &word);
+        switch (tok)
+        {
+            case TOK_WORD :
+                if (depth == 0 && nword == 0 && !g_strcmp0 (word, "profile"))
+                    node->type = KANSHI_PROFILE;
+                else if (node->type == KANSHI_PROFILE && depth == 0 && nword == 1 && !opened)
+                {
+                    node->name = word;
+                    word = NULL;
+                }
+                else if (node->type == KANSHI_PROFILE && depth == 1)
+                {
+                    if (nword == 0) output = !g_strcmp0 (word, "output");
+                    else if (nword == 1 && output)
+                    {
+                        g_ptr_array_add (outputs, word);
+                        word = NULL;
+                    }
+                }
+                g_free (word);
+                nword++;
+                break;
+
+            case TOK_LBRACE :
+                depth++;
+                opened = TRUE;
+                nword = 0;
+                break;
+
+            case TOK_RBRACE :
+                if (depth > 0) depth--;
+                nword = 0;
+                break;
+
+            case TOK_NEWLINE :
+                nword = 0;
+                // a profile's opening brace may be on the line after its name
+                if (node->type == KANSHI_PROFILE && !opened) tok = TOK_WORD;
+                break;
+
+            case TOK_EOF :
+                break;
+        }
+    } while (tok != TOK_EOF && !(tok == TOK_NEWLINE && depth == 0));
+
+    node->text = g_strndup (start, *pos - start);
+    if (node->type == KANSHI_PROFILE)
+    {
+        node->key = output_key (outputs);
+        node->hash = g_str_hash (node->key);
+    }
+    g_ptr_array_free (outputs, TRUE);
+    return node;
+}
+
+static void free_node (kanshi_node_t *node)
+{
+    g_free (node->text);
+    g_free (node->name);
+    g_free (node->key);
+    g_free (node);
+}
+
+GList *kanshi_parse (const char *filename)
+{
+    GList *nodes = NULL;
+    char *data;
+    const char *pos, *end;
+    gsize len;
+
+    if (!g_file_get_contents (filename, &data, &len, NULL)) return NULL;
+
+    pos = data;
+    end = data + len;
+    while (pos < end) nodes = g_list_prepend (nodes, parse_node (&pos, end));
+
+    g_free (data);
+    return g_list_reverse (nodes);
+}
+
+void kanshi_free (GList *nodes)
+{
+    g_list_free_full (nodes, (GDestroyNotify) free_node);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Writing */
+/*----------------------------------------------------------------------------*/
+
+static gboolean is_blank (kanshi_node_t *node)
+{
+    const char *p;
+
+    for (p = node->text; *p; p++)
+        if (!g_ascii_isspace (*p)) return FALSE;
+    return TRUE;
+}
+
+void kanshi_write (GList *nodes, FILE *fp, const char **outputs)
+{
+    GList *ptr;
+    GPtrArray *arr;
+    kanshi_node_t *node;
+    char *key;
+    guint hash;
+    gboolean skipped = FALSE;
+    int n;
+
+    arr = g_ptr_array_new ();
+    for (n = 0; outputs[n]; n++) g_ptr_array_add (arr, (gpointer) outputs[n]);
+    key = output_key (arr);
+    hash = g_str_hash (key);
+    g_ptr_array_free (arr, TRUE);
+
+    // write everything except profiles for the given outputs, which are being replaced
+    for (ptr = nodes; ptr; ptr = ptr->next)
+    {
+        node = (kanshi_node_t *) ptr->data;
+        if (node->type == KANSHI_PROFILE && node->hash == hash && !g_strcmp0 (node->key, key))
+        {
+            skipped = TRUE;
+            continue;
+        }
+
+        // drop the blank lines which followed a replaced profile, so they don't build up
+        if (skipped && is_blank (node)) continue;
+        skipped = FALSE;
+
+        fputs (node->text, fp);
+    }
+
+    g_free (key);
+}
+
+/* End of file */
+/*============================================================================*/
@@ -25,60 +25,96 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
-#include <locale.h>
 #include <gtk/gtk.h>
 #include <glib/gstdio.h>
 #include <libxml/xpathInternals.h>
+#include <libxml/xmlreader.h>
 #include "raindrop.h"
 
 #define XC(str) ((xmlChar *) str)
 
+#define RC_NS "http://openbox.org/3.4/rc"
+
+extern wlr_result_t wlr_apply_config (void);
+extern FILE *open_atomic (const char *filename, char **tmpname);
+extern gboolean close_atomic (FILE *fp, char *tmpname, const char *filename);
+extern gboolean write_atomic (const char *filename, const char *data, gsize len);
+extern gboolean copy_file (const char *src, const char *dst);
+extern gboolean backup_file (const char *filename, const char *backup);
+extern gboolean restore_file (const char *backup, const char *filename);
+extern gboolean file_contains (const char *filename, const char *str);
+extern void install_system_files (const char **files);
+extern wlr_result_t wlr_wait_for_config (monitor_t *expected, int timeout);
+extern GList *kanshi_parse (const char *filename);
+extern void kanshi_free (GList *nodes);
+extern void kanshi_write (GList *nodes, FILE *fp, const char **outputs);
+extern gboolean cache_lookup (const char *filename, gpointer *data, GStatBuf *st);
+extern void cache_store (const char *filename, const GStatBuf *st, gpointer data, GDestroyNotify free_func);
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
 
 const char *orients[4] = { "normal", "90", "180", "270" };
 
+static xmlXPathCompExprPtr root_expr, touch_expr;
+
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
-void update_labwc_system_config (void);
+void update_labwc_system_config (monitor_t *applied);
 static void add_mode (int monitor, int w, int h, float f);
 void load_labwc_config (void);
-static gboolean copy_profile (FILE *fp, FILE *foutp, int nmons);
-static int write_config (FILE *fp);
+static void write_config (FILE *fp, monitor_t *cfg);
 static void merge_configs (const char *infile, const char *outfile);
+static void write_greeter_config (const char *filename, monitor_t *cfg);
 void save_labwc_config (void);
 void init_labwc_config (void);
-void reload_labwc_config (void);
+static wlr_result_t kanshi_reload (void);
+gboolean reload_labwc_config (void);
 void revert_labwc_config (void);
+static void init_xml (void);
+static xmlXPathContextPtr new_context (xmlDocPtr xDoc);
+static gboolean rc_element (xmlTextReaderPtr reader, const char *name);
+static void map_touchscreen (const char *dev, const char *mon, touch_mode_t mode);
+void free_touch_maps (GList *maps);
+static GList *parse_touchscreen_xml (const char *filename);
 static void read_touchscreen_xml (char *filename);
 void load_labwc_touchscreens (void);
-static void write_touchscreens (char *filename);
+static void write_touchscreens (const char **filenames, gboolean prune, monitor_t *cfg);
 void save_labwc_touchscreens (void);
 void reload_labwc_touchscreens (void);
 void revert_labwc_touchscreens (void);
+char *labwc_touch_file (void);
 
 /*----------------------------------------------------------------------------*/
 /* System update */
 /*----------------------------------------------------------------------------*/
 
-void update_labwc_system_config (void)
+void update_labwc_system_config (monitor_t *applied)
 {
-    char *cmd;
-
-    system (SUDO_PREFIX "mkdir -p /etc/xdg/labwc-greeter/");
-
-    cmd = g_strdup_printf (SUDO_PREFIX "cp %s/kanshi/config /etc/xdg/labwc-greeter/config.kanshi",
-        g_get_user_config_dir ());
-    system (cmd);
-    g_free (cmd);
-
-    cmd = g_strdup_printf (SUDO_PREFIX "cp %s/labwc/rcgreeter.xml /etc/xdg/labwc-greeter/rc.xml",
-        g_get_user_config_dir ());
-    system (cmd);
-    g_free (cmd);
+    char *kanshi, *rc;
+
+    // the greeter only ever shows the current layout, so it gets just that profile and
+    // just the current touch mappings, rather than a copy of everything the user has
+    kanshi = g_build_filename (g_get_user_config_dir (), "kanshi/config.greeter", NULL);
+    write_greeter_config (kanshi, applied);
+
+    rc = g_build_filename (g_get_user_config_dir (), "labwc/rcgreeter.xml", NULL);
+    copy_file ("/etc/xdg/labwc-greeter/rc.xml", rc);
+    const char *rcs[] = { rc, NULL };
+    write_touchscreens (rcs, TRUE, applied);
+
+    const char *files[] = {
+        kanshi, "/etc/xdg/labwc-greeter/config.kanshi",
+        rc, "/etc/xdg/labwc-greeter/rc.xml",
+        NULL
+    };
+    install_system_files (files);
+
+    g_free (kanshi);
+    g_free (rc);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -101,12 +137,9 @@ void load_labwc_config (void)
     FILE *fp;
     char *line, *cptr;
     size_t len;
-    int mon, w, h, i;
+    int mon, w, h, i, n;
     float f;
 
-    char *loc = g_strdup (setlocale (LC_NUMERIC, ""));
-    setlocale (LC_NUMERIC, "C");
-
     mon = -1;
 
     fp = popen ("wlr-randr", "r");
@@ -160,13 +193,15 @@ void load_labwc_config (void)
                 }
                 else if (strstr (line, "Scale"))
                 {
-                    sscanf (line, "  Scale: %f", &f);
-                    mons[mon].scale = f;
+                    cptr = strstr (line, "Scale:");
+                    mons[mon].scale = g_ascii_strtod (cptr + 6, NULL);
                 }
             }
             else if (line[4] != ' ')
             {
-                sscanf (line, "    %dx%d px, %f Hz", &w, &h, &f);
+                n = 0;
+                sscanf (line, "    %dx%d px,%n", &w, &h, &n);
+                f = n ? g_ascii_strtod (line + n, NULL) : 0.0;
                 add_mode (mon, w, h, f);
                 if ((mons[mon].enabled && strstr (line, "current"))
                     || (! mons[mon].enabled && strstr (line, "preferred")))
@@ -180,139 +215,104 @@ void load_labwc_config (void)
         free (line);
         pclose (fp);
     }
-
-    setlocale (LC_NUMERIC, loc);
-    g_free (loc);
 }
 
 /*----------------------------------------------------------------------------*/
 /* Writing config */
 /*----------------------------------------------------------------------------*/
 
-static gboolean copy_profile (FILE *fp, FILE *foutp, int nmons)
+static void write_config (FILE *fp, monitor_t *cfg)
 {
-    char *line;
-    size_t len;
-    gboolean valid = FALSE;
-    char *buf, *tmp;
+    char sbuf[G_ASCII_DTOSTR_BUF_SIZE], fbuf[G_ASCII_DTOSTR_BUF_SIZE];
     int m;
 
-    line = NULL;
-    len = 0;
-    while (getline (&line, &len, fp) != -1)
-    {
-        if (strstr (line, "profile"))
-        {
-            valid = TRUE;
-            buf = g_strdup (line);
-        }
-        else if (valid)
-        {
-            if (strstr (line, "}"))
-            {
-                tmp = g_strdup_printf ("%s}\n", buf);
-                g_free (buf);
-                buf = tmp;
-
-                if (nmons) fprintf (foutp, "%s\n", buf);
-                g_free (buf);
-                return TRUE;
-            }
-            else if (strstr (line, "output"))
-            {
-                tmp = g_strdup_printf ("%s%s", buf, line);
-                g_free (buf);
-                buf = tmp;
-
-                for (m = 0; m < MAX_MONS; m++)
-                {
-                    if (mons[m].modes == NULL) continue;
-                    if (strstr (line, mons[m].name)) nmons--;
-                }
-            }
-        }
-    }
-    free (line);
-    return FALSE;
-}
-
-static int write_config (FILE *fp)
-{
-    int m, nmons = 0;
-
-    char *loc = g_strdup (setlocale (LC_NUMERIC, ""));
-    setlocale (LC_NUMERIC, "C");
-
+    // numbers are formatted with g_ascii_formatd so the file is the same in any locale
     fprintf (fp, "profile {\n");
     for (m = 0; m < MAX_MONS; m++)
     {
-        if (mons[m].modes == NULL) continue;
-        nmons++;
-        if (mons[m].enabled == FALSE)
+        if (cfg[m].modes == NULL) continue;
+        if (cfg[m].enabled == FALSE)
         {
-            fprintf (fp, "\t\toutput %s disable\n", mons[m].name);
+            fprintf (fp, "\t\toutput %s disable\n", cfg[m].name);
         }
-        else if (mons[m].freq == 0.0)
+        else if (cfg[m].freq == 0.0)
         {
-            fprintf (fp, "\t\toutput %s enable scale %f mode --custom %dx%d position %d,%d transform %s\n",
-                mons[m].name, mons[m].scale, mons[m].width, mons[m].height,
-                mons[m].x, mons[m].y, orients[mons[m].rotation / 90]);
+            fprintf (fp, "\t\toutput %s enable scale %s mode --custom %dx%d position %d,%d transform %s\n",
+                cfg[m].name, g_ascii_formatd (sbuf, sizeof (sbuf), "%f", cfg[m].scale), cfg[m].width, cfg[m].height,
+                cfg[m].x, cfg[m].y, orients[cfg[m].rotation / 90]);
         }
         else
         {
-            fprintf (fp, "\t\toutput %s enable scale %f mode %dx%d@%.3f position %d,%d transform %s\n",
-                mons[m].name, mons[m].scale, mons[m].width, mons[m].height, mons[m].freq,
-                mons[m].x, mons[m].y, orients[mons[m].rotation / 90]);
+            fprintf (fp, "\t\toutput %s enable scale %s mode %dx%d@%s position %d,%d transform %s\n",
+                cfg[m].name, g_ascii_formatd (sbuf, sizeof (sbuf), "%f", cfg[m].scale), cfg[m].width, cfg[m].height,
+                g_ascii_formatd (fbuf, sizeof (fbuf), "%.3f", cfg[m].freq),
+                cfg[m].x, cfg[m].y, orients[cfg[m].rotation / 90]);
         }
     }
     fprintf (fp, "}\n\n");
-
-    setlocale (LC_NUMERIC, loc);
-    g_free (loc);
-
-    return nmons;
 }
 
 static void merge_configs (const char *infile, const char *outfile)
 {
-    FILE *finp = fopen (infile, "r");
-    FILE *foutp = fopen (outfile, "w");
+    FILE *foutp;
+    GList *nodes;
+    const char *outputs[MAX_MONS + 1];
+    char *tmpname;
+    GStatBuf st;
+    int m, n = 0;
+
+    foutp = open_atomic (outfile, &tmpname);
+    if (!foutp) return;
 
     // write the profile for this config
-    int nmons = write_config (foutp);
+    write_config (foutp, mons);
+
+    // copy the rest of the old config, less any profile for this set of monitors
+    for (m = 0; m < MAX_MONS; m++)
+        if (mons[m].modes) outputs[n++] = mons[m].name;
+    outputs[n] = NULL;
+
+    if (!cache_lookup (infile, (gpointer *) &nodes, &st))
+    {
+        nodes = kanshi_parse (infile);
+        cache_store (infile, &st, nodes, (GDestroyNotify) kanshi_free);
+    }
+    kanshi_write (nodes, foutp, outputs);
+
+    close_atomic (foutp, tmpname, outfile);
+}
 
-    // copy any other profiles
-    while (copy_profile (finp, foutp, nmons));
+static void write_greeter_config (const char *filename, monitor_t *cfg)
+{
+    FILE *fp;
+    char *tmpname;
 
-    fclose (finp);
-    fclose (foutp);
+    fp = open_atomic (filename, &tmpname);
+    if (!fp) return;
+    write_config (fp, cfg);
+    close_atomic (fp, tmpname, filename);
 }
 
 void save_labwc_config (void)
 {
-    char *infile, *outfile, *inifile, *cmd;
+    char *infile, *outfile, *inifile;
 
     infile = g_build_filename (g_get_user_config_dir (), "kanshi/config.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "kanshi/config", NULL);
 
     // check if a valid config file exists
-    cmd = g_strdup_printf ("grep -q profile %s", outfile);
-    if (!system (cmd))
+    if (file_contains (outfile, "profile"))
     {
         // config file - initialise bak from it
-        g_free (cmd);
-        cmd = g_strdup_printf ("cp %s %s", outfile, infile);
-        system (cmd);
+        backup_file (outfile, infile);
     }
     else
     {
         // null config file - initialise bak from ini file
-        g_free (cmd);
         inifile = g_build_filename (g_get_user_config_dir (), "kanshi/config.init", NULL);
-        cmd = g_strdup_printf ("cp %s %s", inifile, infile);
-        system (cmd);
+        backup_file (inifile, infile);
+        g_free (inifile);
     }
-    g_free (cmd);
 
     merge_configs (infile, outfile);
     g_free (infile);
@@ -322,7 +322,7 @@ void save_labwc_config (void)
 void init_labwc_config (void)
 {
     FILE *fp;
-    char *file, *cmd;
+    char *file, *tmpname;
 
     // check the config directory exists
     file = g_build_filename (g_get_user_config_dir (), "kanshi/", NULL);
@@ -331,20 +331,21 @@ void init_labwc_config (void)
 
     // look for an existing valid config file - if there is one, fall out
     file = g_build_filename (g_get_user_config_dir (), "kanshi/config", NULL);
-    cmd = g_strdup_printf ("grep -q profile %s", file);
-    g_free (file);
-    if (!system (cmd))
+    if (file_contains (file, "profile"))
     {
-        g_free (cmd);
+        g_free (file);
         return;
     }
-    g_free (cmd);
+    g_free (file);
 
     // no valid config file - create an init file
     file = g_build_filename (g_get_user_config_dir (), "kanshi/config.init", NULL);
-    fp = fopen (file, "w");
-    write_config (fp);
-    fclose (fp);
+    fp = open_atomic (file, &tmpname);
+    if (fp)
+    {
+        write_config (fp, mons);
+        close_atomic (fp, tmpname, file);
+    }
     g_free (file);
 }
 
@@ -352,20 +353,43 @@ void init_labwc_config (void)
 /* Reload / reversion */
 /*----------------------------------------------------------------------------*/
 
-void reload_labwc_config (void)
+static wlr_result_t kanshi_reload (void)
 {
-    system ("pkill --signal SIGHUP kanshi");
+    char *argv[] = { "kanshictl", "reload", NULL };
+    int status;
+
+    // kanshictl only replies once kanshi has re-read its config and applied the
+    // matching profile, so the new state is live when this returns
+    if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+        NULL, NULL, NULL, NULL, &status, NULL)) return WLR_UNAVAILABLE;
+    return g_spawn_check_wait_status (status, NULL) ? WLR_APPLIED : WLR_FAILED;
+}
+
+gboolean reload_labwc_config (void)
+{
+    wlr_result_t res, kres;
+
+    // apply the new layout directly, as a single tested compositor transaction - if the
+    // compositor rejects it, nothing has changed and the caller puts the old config back
+    res = wlr_apply_config ();
+    if (res == WLR_FAILED) return FALSE;
+
+    // kanshi still needs to re-read its config so it doesn't undo this on the next hotplug;
+    // older kanshi without the control socket only gets an unacknowledged signal
+    kres = kanshi_reload ();
+    if (kres != WLR_APPLIED) system ("pkill --signal SIGHUP kanshi");
+
+    // without the protocol, kanshi applied the layout itself, so its answer is the result
+    return res == WLR_APPLIED || kres != WLR_FAILED;
 }
 
 void revert_labwc_config (void)
 {
-    char *infile, *outfile, *cmd;
+    char *infile, *outfile;
 
     infile = g_build_filename (g_get_user_config_dir (), "kanshi/config.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "kanshi/config", NULL);
-    cmd = g_strdup_printf ("cp %s %s", infile, outfile);
-    system (cmd);
-    g_free (cmd);
+    restore_file (infile, outfile);
     g_free (infile);
     g_free (outfile);
 }
@@ -374,96 +398,159 @@ void revert_labwc_config (void)
 /* Touchscreens */
 /*----------------------------------------------------------------------------*/
 
-static void read_touchscreen_xml (char *filename)
+static void init_xml (void)
+{
+    static gsize init = 0;
+
+    // the parser is set up once per process, with the expressions used on every file
+    if (g_once_init_enter (&init))
+    {
+        xmlInitParser ();
+        LIBXML_TEST_VERSION
+        root_expr = xmlXPathCompile (XC ("/o:openbox_config"));
+        touch_expr = xmlXPathCompile (XC ("/o:openbox_config/o:touch"));
+        g_once_init_leave (&init, 1);
+    }
+}
+
+static xmlXPathContextPtr new_context (xmlDocPtr xDoc)
 {
-    xmlDocPtr xDoc;
-    xmlXPathObjectPtr xpathObj;
     xmlXPathContextPtr xpathCtx;
-    xmlNode *node;
-    xmlAttr *attr;
-    char *dev, *mon;
-    int i, m;
-    touch_mode_t mode;
+
+    xpathCtx = xmlXPathNewContext (xDoc);
+    xmlXPathRegisterNs (xpathCtx, XC ("o"), XC (RC_NS));
+    return xpathCtx;
+}
+
+static gboolean rc_element (xmlTextReaderPtr reader, const char *name)
+{
+    return !g_strcmp0 ((char *) xmlTextReaderConstLocalName (reader), name)
+        && !g_strcmp0 ((char *) xmlTextReaderConstNamespaceUri (reader), RC_NS);
+}
+
+static void map_touchscreen (const char *dev, const char *mon, touch_mode_t mode)
+{
     GList *model;
     gboolean exists;
+    int m;
 
-    if (!g_file_test (filename, G_FILE_TEST_IS_REGULAR)) return;
+    exists = FALSE;
+    model = touchscreens;
+    while (model)
+    {
+        if (!g_strcmp0 ((char *) model->data, dev))
+        {
+            exists = TRUE;
+            break;
+        }
+        model = model->next;
+    }
+    if (!exists) return;
 
-    xmlInitParser ();
-    LIBXML_TEST_VERSION
-    xDoc = xmlReadFile (filename, NULL, XML_PARSE_NOBLANKS);
-    if (xDoc == NULL)
+    for (m = 0; m < MAX_MONS; m++)
     {
-        xmlCleanupParser ();
-        return;
+        if (mons[m].modes == NULL) continue;
+        if (!g_strcmp0 (mons[m].name, mon))
+        {
+            mons[m].touchscreen = g_strdup (dev);
+            mons[m].tmode = mode;
+        }
+        else if (!g_strcmp0 (dev, mons[m].touchscreen))
+        {
+            g_free (mons[m].touchscreen);
+            mons[m].touchscreen = NULL;
+            mons[m].tmode = MODE_NONE;
+        }
     }
+}
 
-    xpathCtx = xmlXPathNewContext (xDoc);
-    xmlXPathRegisterNs (xpathCtx, XC ("o"), XC ("http://openbox.org/3.4/rc"));
+void free_touch_maps (GList *maps)
+{
+    GList *ptr;
+    touch_map_t *map;
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:touch"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    for (ptr = maps; ptr; ptr = ptr->next)
+    {
+        map = (touch_map_t *) ptr->data;
+        g_free (map->device);
+        g_free (map->output);
+        g_free (map);
+    }
+    g_list_free (maps);
+}
+
+static GList *parse_touchscreen_xml (const char *filename)
+{
+    xmlTextReaderPtr reader;
+    xmlChar *dev, *mon, *emu;
+    touch_map_t *map;
+    GList *maps = NULL;
+    int ret, type, depth;
+
+    init_xml ();
+    reader = xmlReaderForFile (filename, NULL, XML_PARSE_NOBLANKS);
+    if (reader == NULL) return NULL;
+
+    // stream through the file, only stepping into the root element - every other
+    // subtree, such as the keybinds and mousebinds, is skipped without being built
+    ret = xmlTextReaderRead (reader);
+    while (ret == 1)
     {
-        for (i = 0; i < xpathObj->nodesetval->nodeNr; i++)
+        type = xmlTextReaderNodeType (reader);
+        depth = xmlTextReaderDepth (reader);
+
+        if (type == XML_READER_TYPE_ELEMENT && depth == 0)
         {
-            node = xpathObj->nodesetval->nodeTab[i];
-            dev = NULL;
-            mon = NULL;
-            mode = MODE_MULTITOUCH;
-            for (attr = node->properties; attr; attr = attr->next)
-            {
-                if (!g_strcmp0 ((char *) attr->name, "deviceName"))
-                    dev = g_strdup ((char *) attr->children->content);
-                if (!g_strcmp0 ((char *) attr->name, "mapToOutput"))
-                    mon = g_strdup ((char *) attr->children->content);
-                if (!g_strcmp0 ((char *) attr->name, "mouseEmulation"))
-                {
-                    if (!g_strcmp0 ((char *) attr->children->content, "yes")) mode = MODE_MOUSEEMU;
-                    else mode = MODE_MULTITOUCH;
-                }
-            }
+            if (!rc_element (reader, "openbox_config")) break;
+            ret = xmlTextReaderRead (reader);
+            continue;
+        }
+
+        if (type == XML_READER_TYPE_ELEMENT && depth == 1 && rc_element (reader, "touch"))
+        {
+            dev = xmlTextReaderGetAttribute (reader, XC ("deviceName"));
+            mon = xmlTextReaderGetAttribute (reader, XC ("mapToOutput"));
+            emu = xmlTextReaderGetAttribute (reader, XC ("mouseEmulation"));
             if (dev && mon)
             {
-                exists = FALSE;
-                model = touchscreens;
-                while (model)
-                {
-                    if (!g_strcmp0 ((char *) model->data, dev))
-                    {
-                        exists = TRUE;
-                        break;
-                    }
-                    model = model->next;
-                }
-                if (exists)
-                {
-                    for (m = 0; m < MAX_MONS; m++)
-                    {
-                        if (mons[m].modes == NULL) continue;
-                        if (!g_strcmp0 (mons[m].name, mon))
-                        {
-                            mons[m].touchscreen = g_strdup (dev);
-                            mons[m].tmode = mode;
-                        }
-                        else if (!g_strcmp0 (dev, mons[m].touchscreen))
-                        {
-                            g_free (mons[m].touchscreen);
-                            mons[m].touchscreen = NULL;
-                            mons[m].tmode = MODE_NONE;
-                        }
-                    }
-                }
+                map = g_new0 (touch_map_t, 1);
+                map->device = g_strdup ((char *) dev);
+                map->output = g_strdup ((char *) mon);
+                map->mode = !g_strcmp0 ((char *) emu, "yes") ? MODE_MOUSEEMU : MODE_MULTITOUCH;
+                maps = g_list_prepend (maps, map);
             }
-            g_free (dev);
-            g_free (mon);
+            xmlFree (dev);
+            xmlFree (mon);
+            xmlFree (emu);
         }
+
+        ret = xmlTextReaderNext (reader);
+    }
+
+    xmlFreeTextReader (reader);
+    return g_list_reverse (maps);
+}
+
+static void read_touchscreen_xml (char *filename)
+{
+    GList *maps, *ptr;
+    touch_map_t *map;
+    GStatBuf st;
+
+    if (!g_file_test (filename, G_FILE_TEST_IS_REGULAR)) return;
+
+    // the system rc.xml hardly ever changes, so is normally only parsed once
+    if (!cache_lookup (filename, (gpointer *) &maps, &st))
+    {
+        maps = parse_touchscreen_xml (filename);
+        cache_store (filename, &st, maps, (GDestroyNotify) free_touch_maps);
     }
-    xmlXPathFreeObject (xpathObj);
 
-    // cleanup XML
-    xmlXPathFreeContext (xpathCtx);
-    xmlFreeDoc (xDoc);
-    xmlCleanupParser ();
+    for (ptr = maps; ptr; ptr = ptr->next)
+    {
+        map = (touch_map_t *) ptr->data;
+        map_touchscreen (map->device, map->output, map->mode);
+    }
 }
 
 void load_labwc_touchscreens (void)
@@ -477,67 +564,110 @@ void load_labwc_touchscreens (void)
     g_free (infile);
 }
 
-static void write_touchscreens (char *filename)
+static void write_touchscreens (const char **filenames, gboolean prune, monitor_t *cfg)
 {
     xmlDocPtr xDoc;
     xmlNode *root, *child_node;
     xmlXPathObjectPtr xpathObj;
     xmlXPathContextPtr xpathCtx;
-    char *cptr;
-    int m;
+    xmlChar *buf, *dev;
+    GHashTable *nodes;
+    GHashTableIter iter;
+    GSList *dups = NULL, *dup;
+    gpointer node;
+    int f, i, m, len;
 
-    xmlInitParser ();
-    LIBXML_TEST_VERSION
-    if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
-    {
-        xDoc = xmlReadFile (filename, NULL, XML_PARSE_NOBLANKS);
-        if (!xDoc) xDoc = xmlNewDoc (XC ("1.0"));
-    }
-    else xDoc = xmlNewDoc (XC ("1.0"));
-    xpathCtx = xmlXPathNewContext (xDoc);
-    xmlXPathRegisterNs (xpathCtx, XC ("o"), XC ("http://openbox.org/3.4/rc"));
+    init_xml ();
 
-    // check the root node exists
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config"), xpathCtx);
-    if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    for (f = 0; filenames[f]; f++)
     {
-        root = xmlNewNode (NULL, XC ("openbox_config"));
-        xmlNewNs (root, XC ("http://openbox.org/3.4/rc"), NULL);
-        xmlDocSetRootElement (xDoc, root);
-    }
-    else root = xpathObj->nodesetval->nodeTab[0];
-    xmlXPathFreeObject (xpathObj);
+        if (g_file_test (filenames[f], G_FILE_TEST_IS_REGULAR))
+        {
+            xDoc = xmlReadFile (filenames[f], NULL, XML_PARSE_NOBLANKS);
+            if (!xDoc) xDoc = xmlNewDoc (XC ("1.0"));
+        }
+        else xDoc = xmlNewDoc (XC ("1.0"));
+        xpathCtx = new_context (xDoc);
 
-    for (m = 0; m < MAX_MONS; m++)
-    {
-        if (mons[m].modes == NULL) continue;
-        if (mons[m].touchscreen == NULL) continue;
+        // check the root node exists
+        xpathObj = xmlXPathCompiledEval (root_expr, xpathCtx);
+        if (!xpathObj || xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+        {
+            root = xmlNewNode (NULL, XC ("openbox_config"));
+            xmlNewNs (root, XC (RC_NS), NULL);
+            xmlDocSetRootElement (xDoc, root);
+        }
+        else root = xpathObj->nodesetval->nodeTab[0];
+        xmlXPathFreeObject (xpathObj);
 
-        cptr = g_strdup_printf ("/o:openbox_config/o:touch[@deviceName='%s']", mons[m].touchscreen);
-        xpathObj = xmlXPathEvalExpression (XC (cptr), xpathCtx);
-        g_free (cptr);
+        // index the existing touch nodes by device name, in one walk
+        nodes = g_hash_table_new_full (g_str_hash, g_str_equal, xmlFree, NULL);
+        xpathObj = xmlXPathCompiledEval (touch_expr, xpathCtx);
+        if (xpathObj && !xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+        {
+            for (i = 0; i < xpathObj->nodesetval->nodeNr; i++)
+            {
+                dev = xmlGetProp (xpathObj->nodesetval->nodeTab[i], XC ("deviceName"));
+                if (!dev) continue;
+                if (g_hash_table_contains (nodes, dev))
+                {
+                    xmlFree (dev);
+                    if (prune) dups = g_slist_prepend (dups, xpathObj->nodesetval->nodeTab[i]);
+                }
+                else g_hash_table_insert (nodes, dev, xpathObj->nodesetval->nodeTab[i]);
+            }
+        }
+        xmlXPathFreeObject (xpathObj);
 
-        if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+        // duplicates can only be freed once the node set no longer refers to them
+        for (dup = dups; dup; dup = dup->next)
         {
-            child_node = xmlNewChild (root, NULL, XC ("touch"), NULL);
-            xmlSetProp (child_node, XC ("deviceName"), XC (mons[m].touchscreen));
+            xmlUnlinkNode (dup->data);
+            xmlFreeNode (dup->data);
         }
-        else child_node = xpathObj->nodesetval->nodeTab[0];
+        g_slist_free (dups);
+        dups = NULL;
 
-        xmlSetProp (child_node, XC ("mapToOutput"), XC (mons[m].name));
-        xmlSetProp (child_node, XC ("mouseEmulation"), mons[m].tmode == MODE_MOUSEEMU ? XC ("yes") : XC ("no"));
-        xmlXPathFreeObject (xpathObj);
-    }
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (cfg[m].modes == NULL) continue;
+            if (cfg[m].touchscreen == NULL) continue;
 
-    xmlXPathFreeContext (xpathCtx);
-    xmlSaveFormatFile (filename, xDoc, 1);
-    xmlFreeDoc (xDoc);
-    xmlCleanupParser ();
+            child_node = g_hash_table_lookup (nodes, cfg[m].touchscreen);
+            if (child_node) g_hash_table_remove (nodes, cfg[m].touchscreen);
+            else
+            {
+                child_node = xmlNewChild (root, NULL, XC ("touch"), NULL);
+                xmlSetProp (child_node, XC ("deviceName"), XC (cfg[m].touchscreen));
+            }
+
+            xmlSetProp (child_node, XC ("mapToOutput"), XC (cfg[m].name));
+            xmlSetProp (child_node, XC ("mouseEmulation"), cfg[m].tmode == MODE_MOUSEEMU ? XC ("yes") : XC ("no"));
+        }
+
+        // anything left in the table is a mapping which is no longer in use
+        if (prune)
+        {
+            g_hash_table_iter_init (&iter, nodes);
+            while (g_hash_table_iter_next (&iter, NULL, &node))
+            {
+                xmlUnlinkNode (node);
+                xmlFreeNode (node);
+            }
+        }
+        g_hash_table_destroy (nodes);
+
+        xmlXPathFreeContext (xpathCtx);
+        xmlDocDumpFormatMemory (xDoc, &buf, &len, 1);
+        write_atomic (filenames[f], (char *) buf, len);
+        xmlFree (buf);
+        xmlFreeDoc (xDoc);
+    }
 }
 
 void save_labwc_touchscreens (void)
 {
-    char *infile, *outfile, *cmd;
+    char *infile, *outfile;
 
     char *dir = g_build_filename (g_get_user_config_dir (), "labwc/", NULL);
     g_mkdir_with_parents (dir, S_IRUSR | S_IWUSR | S_IXUSR);
@@ -545,18 +675,12 @@ void save_labwc_touchscreens (void)
 
     infile = g_build_filename (g_get_user_config_dir (), "labwc/rc.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
-    cmd = g_strdup_printf ("cp %s %s", outfile, infile);
-    system (cmd);
-    g_free (cmd);
-    write_touchscreens (outfile);
-    g_free (infile);
-    g_free (outfile);
+    backup_file (outfile, infile);
+
+    const char *files[] = { outfile, NULL };
+    write_touchscreens (files, FALSE, mons);
 
-    outfile = g_build_filename (g_get_user_config_dir (), "labwc/rcgreeter.xml", NULL);
-    cmd = g_strdup_printf ("cp /etc/xdg/labwc-greeter/rc.xml %s", outfile);
-    system (cmd);
-    g_free (cmd);
-    write_touchscreens (outfile);
+    g_free (infile);
     g_free (outfile);
 }
 
@@ -567,17 +691,24 @@ void reload_labwc_touchscreens (void)
 
 void revert_labwc_touchscreens (void)
 {
-    char *infile, *outfile, *cmd;
+    char *infile, *outfile;
 
     infile = g_build_filename (g_get_user_config_dir (), "labwc/rc.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
-    cmd = g_strdup_printf ("cp %s %s", infile, outfile);
-    system (cmd);
-    g_free (cmd);
+    restore_file (infile, outfile);
     g_free (infile);
     g_free (outfile);
 }
 
+/*----------------------------------------------------------------------------*/
+/* Watched files */
+/*----------------------------------------------------------------------------*/
+
+char *labwc_touch_file (void)
+{
+    return g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Function table */
 /*----------------------------------------------------------------------------*/
@@ -592,7 +723,9 @@ wm_functions_t labwc_functions = {
     .reload_touchscreens = reload_labwc_touchscreens,
     .revert_config = revert_labwc_config,
     .revert_touchscreens = revert_labwc_touchscreens,
-    .update_system_config = update_labwc_system_config
+    .update_system_config = update_labwc_system_config,
+    .wait_for_config = wlr_wait_for_config,
+    .touch_file = labwc_touch_file
 };
 
 /* End of file */
@@ -25,10 +25,19 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
-#include <locale.h>
 #include <gtk/gtk.h>
 #include "raindrop.h"
 
+extern FILE *open_atomic (const char *filename, char **tmpname);
+extern gboolean close_atomic (FILE *fp, char *tmpname, const char *filename);
+extern gboolean backup_file (const char *filename, const char *backup);
+extern gboolean restore_file (const char *backup, const char *filename);
+extern void install_system_files (const char **files);
+
+#define TOUCH_CONF_NAME "99-raindrop-touch.conf"
+#define TOUCH_CONF "/var/tmp/" TOUCH_CONF_NAME
+#define TOUCH_CONF_BAK "/var/tmp/raindrop-touch.bak"
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
@@ -39,27 +48,33 @@ const char *xorients[4] = { "normal", "left", "inverted", "right" };
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
-void update_openbox_system_config (void);
+void update_openbox_system_config (monitor_t *);
 static void add_mode_i (int monitor, int w, int h, float f, gboolean i);
 void load_openbox_config (void);
 static void write_dispsetup (const char *infile);
 void save_openbox_config (void);
 void init_openbox_config (void);
-void reload_openbox_config (void);
+gboolean reload_openbox_config (void);
 void revert_openbox_config (void);
+static void screen_size (int *sw, int *sh);
+static void touch_matrix (int mon, int sw, int sh, double *matrix);
+static char *format_matrix (const double *matrix, int n);
+static gboolean read_matrix (const char *dev, const char *prop, float *matrix);
 void load_openbox_touchscreens (void);
+static void write_touch_conf (const char *filename);
+void save_openbox_touchscreens (void);
+void reload_openbox_touchscreens (void);
+void revert_openbox_touchscreens (void);
 
 /*----------------------------------------------------------------------------*/
 /* System update */
 /*----------------------------------------------------------------------------*/
 
-void update_openbox_system_config (void)
+void update_openbox_system_config (monitor_t *)
 {
-    char *cmd;
-
-    cmd = g_strdup_printf (SUDO_PREFIX "cp /var/tmp/dispsetup.sh /usr/share/dispsetup.sh");
-    system (cmd);
-    g_free (cmd);
+    const char *files[] = { "/var/tmp/dispsetup.sh", "/usr/share/dispsetup.sh",
+        TOUCH_CONF, "/etc/X11/xorg.conf.d/" TOUCH_CONF_NAME, NULL };
+    install_system_files (files);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -86,9 +101,6 @@ void load_openbox_config (void)
     gboolean inter;
     float f;
 
-    char *loc = g_strdup (setlocale (LC_NUMERIC, ""));
-    setlocale (LC_NUMERIC, "C");
-
     mon = -1;
 
     fp = popen ("xrandr", "r");
@@ -137,7 +149,7 @@ void load_openbox_config (void)
                     }
                     if (strstr (cptr, "."))
                     {
-                        sscanf (cptr, "%f", &f);
+                        f = g_ascii_strtod (cptr, NULL);
                         add_mode_i (mon, w, h, f, inter);
                     }
                     if (mons[mon].enabled && strstr (cptr, "*"))
@@ -159,9 +171,6 @@ void load_openbox_config (void)
         free (line);
         pclose (fp);
     }
-
-    setlocale (LC_NUMERIC, loc);
-    g_free (loc);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -170,20 +179,18 @@ void load_openbox_config (void)
 
 static void write_dispsetup (const char *infile)
 {
-    char *cmd, *mstr, *tmp;
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    char *cmd, *mstr, *tmp, *tmpname;
     int m;
     FILE *fp;
 
-    char *loc = g_strdup (setlocale (LC_NUMERIC, ""));
-    setlocale (LC_NUMERIC, "C");
-
     cmd = g_strdup ("xrandr");
     for (m = 0; m < MAX_MONS; m++)
     {
         if (mons[m].modes == NULL) continue;
         if (mons[m].enabled)
-            mstr = g_strdup_printf ("--output %s%s --mode %dx%d%s --rate %0.3f --pos %dx%d --rotate %s", mons[m].name, mons[m].primary ? " --primary" : "",
-                mons[m].width, mons[m].height, mons[m].interlaced ? "i" : "", mons[m].freq, mons[m].x, mons[m].y, xorients[mons[m].rotation / 90]);
+            mstr = g_strdup_printf ("--output %s%s --mode %dx%d%s --rate %s --pos %dx%d --rotate %s", mons[m].name, mons[m].primary ? " --primary" : "",
+                mons[m].width, mons[m].height, mons[m].interlaced ? "i" : "", g_ascii_formatd (buf, sizeof (buf), "%.3f", mons[m].freq), mons[m].x, mons[m].y, xorients[mons[m].rotation / 90]);
         else
             mstr = g_strdup_printf ("--output %s --off", mons[m].name);
         tmp = g_strdup_printf ("%s %s", cmd, mstr);
@@ -192,35 +199,28 @@ static void write_dispsetup (const char *infile)
         cmd = tmp;
     }
 
-    fp = fopen (infile, "wb");
-    fprintf (fp, "#!/bin/sh\nif %s --dryrun; then\n\t%s\nfi\n", cmd, cmd);
-    g_free (cmd);
-
-    for (m = 0; m < MAX_MONS; m++)
+    fp = open_atomic (infile, &tmpname);
+    if (!fp)
     {
-        if (mons[m].modes == NULL) continue;
-        if (mons[m].touchscreen == NULL) continue;
-        cmd = g_strdup_printf ("xinput --map-to-output pointer:\"%s\" %s", mons[m].touchscreen, mons[m].name);
-        fprintf (fp, "if xinput | grep -q \"%s\" ; then\n\t%s\nfi\n", mons[m].touchscreen, cmd);
         g_free (cmd);
+        return;
     }
+    // xrandr checks every output and mode, and picks the CRTCs, before it changes
+    // anything, so a dry run adds nothing; the CRTCs are then set one at a time, and
+    // xrandr tries to put them back if one fails part-way
+    fprintf (fp, "#!/bin/sh\n%s 2> /dev/null\n", cmd);
+    g_free (cmd);
 
-    fprintf (fp, "if [ -e /usr/share/ovscsetup.sh ] ; then\n\t/usr/share/ovscsetup.sh\nfi\nexit 0");
-    fclose (fp);
-
-    setlocale (LC_NUMERIC, loc);
-    g_free (loc);
+    fprintf (fp, "[ -x /usr/share/ovscsetup.sh ] && /usr/share/ovscsetup.sh\nexit 0\n");
+    close_atomic (fp, tmpname, infile);
 }
 
 void save_openbox_config (void)
 {
     const char *infile = "/var/tmp/dispsetup.bak";
     const char *outfile = "/var/tmp/dispsetup.sh";
-    char *cmd;
 
-    cmd = g_strdup_printf ("cp %s %s", outfile, infile);
-    system (cmd);
-    g_free (cmd);
+    backup_file (outfile, infile);
     write_dispsetup (outfile);
 }
 
@@ -234,38 +234,165 @@ void init_openbox_config (void)
 /* Reload / reversion */
 /*----------------------------------------------------------------------------*/
 
-void reload_openbox_config (void)
+gboolean reload_openbox_config (void)
 {
-    system ("/bin/bash /var/tmp/dispsetup.sh > /dev/null");
+    return system ("/bin/bash /var/tmp/dispsetup.sh > /dev/null") == 0;
 }
 
 void revert_openbox_config (void)
 {
     const char *infile = "/var/tmp/dispsetup.bak";
     const char *outfile = "/var/tmp/dispsetup.sh";
-    char *cmd;
 
-    cmd = g_strdup_printf ("cp %s %s", infile, outfile);
-    system (cmd);
-    g_free (cmd);
+    restore_file (infile, outfile);
 }
 
 /*----------------------------------------------------------------------------*/
 /* Touchscreens */
 /*----------------------------------------------------------------------------*/
 
+// The mapping is written as a transformation matrix in an xorg.conf.d snippet, so it is
+// in place as soon as X opens the device, rather than being set up by xinput at each login.
+// It is the same matrix xinput --map-to-output would calculate, and only X reads it, so
+// Wayland sessions on the same system are not affected.
+
+static void screen_size (int *sw, int *sh)
+{
+    int m;
+
+    // xrandr sizes the screen to the bounding box of the enabled outputs
+    *sw = *sh = 0;
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL || !mons[m].enabled) continue;
+        if (mons[m].rotation == 90 || mons[m].rotation == 270)
+        {
+            *sw = MAX (*sw, mons[m].x + mons[m].height);
+            *sh = MAX (*sh, mons[m].y + mons[m].width);
+        }
+        else
+        {
+            *sw = MAX (*sw, mons[m].x + mons[m].width);
+            *sh = MAX (*sh, mons[m].y + mons[m].height);
+        }
+    }
+}
+
+static void touch_matrix (int mon, int sw, int sh, double *matrix)
+{
+    double x, y, w, h;
+
+    x = (double) mons[mon].x / sw;
+    y = (double) mons[mon].y / sh;
+    if (mons[mon].rotation == 90 || mons[mon].rotation == 270)
+    {
+        w = (double) mons[mon].height / sw;
+        h = (double) mons[mon].width / sh;
+    }
+    else
+    {
+        w = (double) mons[mon].width / sw;
+        h = (double) mons[mon].height / sh;
+    }
+
+    matrix[0] = 0.0;
+    matrix[1] = 0.0;
+    matrix[2] = x;
+    matrix[3] = 0.0;
+    matrix[4] = 0.0;
+    matrix[5] = y;
+
+    switch (mons[mon].rotation)
+    {
+        case 90 :   matrix[1] = -w;
+                    matrix[3] = h;
+                    matrix[2] += w;
+                    break;
+
+        case 180 :  matrix[0] = -w;
+                    matrix[4] = -h;
+                    matrix[2] += w;
+                    matrix[5] += h;
+                    break;
+
+        case 270 :  matrix[1] = w;
+                    matrix[3] = -h;
+                    matrix[5] += h;
+                    break;
+
+        default :   matrix[0] = w;
+                    matrix[4] = h;
+                    break;
+    }
+}
+
+static char *format_matrix (const double *matrix, int n)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    GString *str;
+    int i;
+
+    // always with a point as the decimal separator, whatever the locale
+    str = g_string_new (NULL);
+    for (i = 0; i < n; i++)
+    {
+        if (i) g_string_append_c (str, ' ');
+        g_string_append (str, g_ascii_formatd (buf, sizeof (buf), "%.6f", matrix[i]));
+    }
+    return g_string_free (str, FALSE);
+}
+
+static gboolean read_matrix (const char *dev, const char *prop, float *matrix)
+{
+    FILE *fp;
+    char *cmd, *line, *cptr, *end, *ptr, *arg;
+    size_t len;
+    int i;
+    gboolean res = FALSE;
+
+    ptr = g_strdup_printf ("pointer:%s", dev);
+    arg = g_shell_quote (ptr);
+    cmd = g_strdup_printf ("xinput --list-props %s | grep \"%s\" | cut -d : -f 2", arg, prop);
+    g_free (arg);
+    g_free (ptr);
+    fp = popen (cmd, "r");
+    if (fp)
+    {
+        line = NULL;
+        len = 0;
+        if (getline (&line, &len, fp) != -1)
+        {
+            // the values are comma-separated, always with a point as the decimal separator
+            cptr = line;
+            for (i = 0; i < 6; i++)
+            {
+                matrix[i] = g_ascii_strtod (cptr, &end);
+                if (end == cptr) break;
+                cptr = end;
+                while (*cptr == ',' || *cptr == ' ') cptr++;
+            }
+            if (i == 6)
+            {
+                if (matrix[0] != 1.0 || matrix[1] != 0.0 || matrix[2] != 0.0 || matrix[3] != 0.0 || matrix[4] != 1.0 || matrix[5] != 0.0)
+                    res = TRUE;
+            }
+        }
+        free (line);
+        pclose (fp);
+    }
+    g_free (cmd);
+    return res;
+}
+
 void load_openbox_touchscreens (void)
 {
     FILE *fp;
     GList *ts;
     int sw, sh, tw, th, tx, ty, m;
-    char *cmd;
     float matrix[6];
 
-    char *loc = g_strdup (setlocale (LC_NUMERIC, ""));
-    setlocale (LC_NUMERIC, "C");
-
     // get the screen size
+    sw = sh = -1;
     fp = popen ("xrandr | grep current  | cut -d \" \" -f 8,10", "r");
     if (fp)
     {
@@ -282,47 +409,119 @@ void load_openbox_touchscreens (void)
     ts = touchscreens;
     while (ts)
     {
-        cmd = g_strdup_printf ("xinput --list-props \"pointer:%s\" | grep Coordinate | cut -d : -f 2", (char *) ts->data);
-        fp = popen (cmd, "r");
-        if (fp)
+        if (read_matrix ((char *) ts->data, "Coordinate Transformation Matrix", matrix))
         {
-            if (fscanf (fp, "%f, %f, %f, %f, %f, %f,", matrix, matrix + 1, matrix + 2, matrix + 3, matrix + 4, matrix + 5) == 6)
+            tw = ((float) sw + 0.5) * (matrix[0] + matrix[1]);
+            th = ((float) sh + 0.5) * (matrix[3] + matrix[4]);
+            tx = ((float) sw + 0.5) * matrix[2];
+            ty = ((float) sh + 0.5) * matrix[5];
+            if (tw < 0) tx += tw;
+            if (th < 0) ty += th;
+            if (tw * th < 0)
             {
-                if (matrix[0] != 1.0 || matrix[1] != 0.0 || matrix[2] != 0.0 || matrix[3] != 0.0 || matrix[4] != 1.0 || matrix[5] != 0.0)
-                {
-                    tw = ((float) sw + 0.5) * (matrix[0] + matrix[1]);
-                    th = ((float) sh + 0.5) * (matrix[3] + matrix[4]);
-                    tx = ((float) sw + 0.5) * matrix[2];
-                    ty = ((float) sh + 0.5) * matrix[5];
-                    if (tw < 0) tx += tw;
-                    if (th < 0) ty += th;
-                    if (tw * th < 0)
-                    {
-                        m = tw;
-                        tw = th;
-                        th = m;
-                    }
-                    if (tw < 0) tw *= -1;
-                    if (th < 0) th *= -1;
+                m = tw;
+                tw = th;
+                th = m;
+            }
+            if (tw < 0) tw *= -1;
+            if (th < 0) th *= -1;
 
-                    for (m = 0; m < MAX_MONS; m++)
-                    {
-                        if (mons[m].modes == NULL) continue;
-                        if (mons[m].width == tw && mons[m].height == th && mons[m].x == tx && mons[m].y == ty)
-                        {
-                            mons[m].touchscreen = g_strdup ((char *) ts->data);
-                        }
-                    }
+            for (m = 0; m < MAX_MONS; m++)
+            {
+                if (mons[m].modes == NULL) continue;
+                if (mons[m].width == tw && mons[m].height == th && mons[m].x == tx && mons[m].y == ty)
+                {
+                    mons[m].touchscreen = g_strdup ((char *) ts->data);
                 }
             }
-            pclose (fp);
         }
-        g_free (cmd);
         ts = ts->next;
     }
+}
+
+static void write_touch_conf (const char *filename)
+{
+    FILE *fp;
+    char *tmpname, *mstr;
+    double matrix[9];
+    int m, sw, sh;
+
+    screen_size (&sw, &sh);
 
-    setlocale (LC_NUMERIC, loc);
-    g_free (loc);
+    fp = open_atomic (filename, &tmpname);
+    if (!fp) return;
+
+    // the file is always written, so that a mapping which has been removed is cleared
+    fprintf (fp, "# Touchscreen to display mapping - generated by raindrop\n");
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL || !mons[m].enabled) continue;
+        if (mons[m].touchscreen == NULL || sw == 0 || sh == 0) continue;
+
+        // an xorg.conf string ends at a quote or newline, with no way to escape either,
+        // and MatchProduct splits on '|' - such a name can't be matched, so it only gets
+        // the session mapping from xinput
+        if (strpbrk (mons[m].touchscreen, "\"|\n\r"))
+        {
+            g_warning ("touchscreen name %s cannot be written to %s", mons[m].touchscreen, TOUCH_CONF_NAME);
+            continue;
+        }
+
+        memset (matrix, 0, sizeof (matrix));
+        matrix[8] = 1.0;
+        touch_matrix (m, sw, sh, matrix);
+        mstr = format_matrix (matrix, 9);
+        fprintf (fp, "\nSection \"InputClass\"\n\tIdentifier \"raindrop touchscreen %d\"\n\tMatchProduct \"%s\"\n"
+            "\tOption \"TransformationMatrix\" \"%s\"\nEndSection\n", m, mons[m].touchscreen, mstr);
+        g_free (mstr);
+    }
+    close_atomic (fp, tmpname, filename);
+}
+
+void save_openbox_touchscreens (void)
+{
+    backup_file (TOUCH_CONF, TOUCH_CONF_BAK);
+    write_touch_conf (TOUCH_CONF);
+}
+
+void reload_openbox_touchscreens (void)
+{
+    GString *cmd;
+    GList *ts;
+    double matrix[9];
+    char *mstr, *arg, *dev;
+    int m, sw, sh;
+
+    // the snippet only takes effect when X next opens the device, so set the same
+    // matrix on the running session - every touchscreen is set, to clear removed mappings
+    screen_size (&sw, &sh);
+
+    cmd = g_string_new (NULL);
+    for (ts = touchscreens; ts; ts = ts->next)
+    {
+        memset (matrix, 0, sizeof (matrix));
+        matrix[0] = matrix[4] = matrix[8] = 1.0;
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL || !mons[m].enabled || sw == 0 || sh == 0) continue;
+            if (!g_strcmp0 (mons[m].touchscreen, (char *) ts->data)) touch_matrix (m, sw, sh, matrix);
+        }
+        mstr = format_matrix (matrix, 9);
+        dev = g_strdup_printf ("pointer:%s", (char *) ts->data);
+        arg = g_shell_quote (dev);
+        g_string_append_printf (cmd, "xinput set-prop %s \"Coordinate Transformation Matrix\" %s 2> /dev/null; ", arg, mstr);
+        g_free (arg);
+        g_free (dev);
+        g_free (mstr);
+    }
+
+    if (cmd->len) system (cmd->str);
+    g_string_free (cmd, TRUE);
+}
+
+void revert_openbox_touchscreens (void)
+{
+    restore_file (TOUCH_CONF_BAK, TOUCH_CONF);
 }
 
 void noop (void) {};
@@ -336,11 +535,11 @@ wm_functions_t openbox_functions = {
     .load_config = load_openbox_config,
     .load_touchscreens = load_openbox_touchscreens,
     .save_config = save_openbox_config,
-    .save_touchscreens = noop,
+    .save_touchscreens = save_openbox_touchscreens,
     .reload_config = reload_openbox_config,
-    .reload_touchscreens = noop,
+    .reload_touchscreens = reload_openbox_touchscreens,
     .revert_config = revert_openbox_config,
-    .revert_touchscreens = noop,
+    .revert_touchscreens = revert_openbox_touchscreens,
     .update_system_config = update_openbox_system_config
 };
 
@@ -37,6 +37,9 @@ extern wm_functions_t labwc_functions;
 extern wm_functions_t openbox_functions;
 extern wm_functions_t wayfire_functions;
 
+extern void init_budget (void);
+extern const char *check_budget (long mon, monitor_t *cand);
+
 /*----------------------------------------------------------------------------*/
 /* Typedefs and macros */
 /*----------------------------------------------------------------------------*/
@@ -46,6 +49,13 @@ extern wm_functions_t wayfire_functions;
 #define TEXTURE_W 4096
 #define TEXTURE_H 4096
 
+#define SETTLE_TIMEOUT 5000
+#define SETTLE_UNKNOWN -2
+
+#define WATCH_LAYOUT 1
+#define WATCH_TOUCH 2
+#define WATCH_DELAY 250
+
 #define SCALE(n) ((n) / scale)
 #define UPSCALE(n) ((n) * scale)
 
@@ -54,32 +64,44 @@ extern wm_functions_t wayfire_functions;
 /*----------------------------------------------------------------------------*/
 
 static GtkBuilder *builder;
-static GtkWidget *da, *main_dlg, *undo, *zin, *zout, *conf, *clbl, *cpb, *ident, *overlay, *zooms;
+static GtkWidget *da, *main_dlg, *undo, *zin, *zout, *conf, *clbl, *cpb, *cok, *ccan, *ident, *overlay, *zooms;
 static GtkWidget *id[MAX_MONS], *lbl[MAX_MONS];
 
 monitor_t mons[MAX_MONS];
 static monitor_t bmons[MAX_MONS];
+static monitor_t pmons[MAX_MONS];
 
 GList *touchscreens;
 
-static int mousex, mousey, screenw, screenh, curmon, scale, rev_time, tid;
-static gboolean pressed;
+static int mousex, mousey, screenw, screenh, curmon, scale, rev_time, tid, pid, settle_ms;
+static gboolean pressed, busy, confirmed, rejected, failed;
+static GCancellable *cancellable;
 static double press_x, press_y;
 static wm_type wm;
 
 static wm_functions_t wm_fn;
 
+static GFileMonitor *watches[2];
+static guint wid, hid;
+static long changes;
+static gboolean hotplugged;
+
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
 static int screen_w (monitor_t mon);
 static int screen_h (monitor_t mon);
+static void copy_monitor (monitor_t *from, monitor_t *to);
 static void copy_config (monitor_t *from, monitor_t *to);
 static gboolean compare_config (monitor_t *from, monitor_t *to);
 static void clear_config (gboolean first);
 static gint mode_compare (gconstpointer a, gconstpointer b);
 static void sort_modes (void);
+static gboolean refresh_config (void);
+static void queue_tile (monitor_t *mon);
+static gboolean hotplug_config (gpointer);
+static void monitors_changed (GdkDisplay *, GdkMonitor *, gpointer);
 static void draw (GtkDrawingArea *, cairo_t *cr, gpointer);
 static void check_frequency (int mon);
 static void set_resolution (GtkMenuItem *item, gpointer data);
@@ -102,7 +124,19 @@ static void set_timer_msg (void);
 static void handle_cancel (GtkButton *, gpointer);
 static void handle_ok (GtkButton *, gpointer);
 static gboolean revert_timeout (gpointer data);
+static gboolean pulse_progress (gpointer);
+static void show_modal (void);
+static void close_modal (void);
+static void show_progress (const char *msg, gboolean can_cancel);
 static void show_confirm_dialog (void);
+static void show_failure (void);
+static void run_task (GTaskThreadFunc func, GAsyncReadyCallback callback);
+static gboolean reload_and_settle (monitor_t *expected);
+static void apply_thread (GTask *task, gpointer, gpointer, GCancellable *cancel);
+static void apply_done (GObject *, GAsyncResult *res, gpointer);
+static void undo_thread (GTask *task, gpointer, gpointer, GCancellable *);
+static void undo_done (GObject *, GAsyncResult *res, gpointer);
+static void wait_for_task (void);
 static void find_touchscreens (void);
 static void find_backlights (void);
 static int get_backlight (int mon);
@@ -121,8 +155,14 @@ static gboolean hide_ids (gpointer);
 static void identify_monitors (void);
 static void handle_ident (GtkButton *, gpointer);
 static void init_config (void);
+static void refresh_touchscreens (void);
+static gboolean refresh_watched (gpointer);
+static void file_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer data);
+static void watch_files (void);
+static void unwatch_files (void);
 static void load_scale (void);
 static void save_scale (void);
+static void update_system (void);
 #ifndef PLUGIN_NAME
 static void handle_close (GtkButton *, gpointer);
 static void close_prog (GtkWidget *, GdkEvent *, gpointer);
@@ -144,24 +184,30 @@ static int screen_h (monitor_t mon)
     else return mon.height / mon.scale;
 }
 
+static void copy_monitor (monitor_t *from, monitor_t *to)
+{
+    to->enabled = from->enabled;
+    to->width = from->width;
+    to->height = from->height;
+    to->x = from->x;
+    to->y = from->y;
+    to->rotation = from->rotation;
+    to->freq = from->freq;
+    to->interlaced = from->interlaced;
+    to->primary = from->primary;
+    to->scale = from->scale;
+    to->tmode = from->tmode;
+    if (to->touchscreen) g_free (to->touchscreen);
+    to->touchscreen = g_strdup (from->touchscreen);
+}
+
 static void copy_config (monitor_t *from, monitor_t *to)
 {
     int m;
     for (m = 0; m < MAX_MONS; m++)
     {
-        if (from[m].modes == NULL) continue;
-        to[m].enabled = from[m].enabled;
-        to[m].width = from[m].width;
-        to[m].height = from[m].height;
-        to[m].x = from[m].x;
-        to[m].y = from[m].y;
-        to[m].rotation = from[m].rotation;
-        to[m].freq = from[m].freq;
-        to[m].interlaced = from[m].interlaced;
-        to[m].primary = from[m].primary;
-        to[m].scale = from[m].scale;
-        if (to[m].touchscreen) g_free (to[m].touchscreen);
-        if (from[m].touchscreen) to[m].touchscreen = g_strdup (from[m].touchscreen);
+        if (mons[m].modes == NULL) continue;
+        copy_monitor (&from[m], &to[m]);
     }
 }
 
@@ -241,6 +287,213 @@ static void sort_modes (void)
     }
 }
 
+static gboolean refresh_config (void)
+{
+    monitor_t old[MAX_MONS];
+    int m;
+
+    // only the current state is re-read - names, modes, backlights and touchscreens are kept
+    memcpy (old, mons, sizeof (old));
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        mons[m].name = NULL;
+        mons[m].modes = NULL;
+        mons[m].enabled = FALSE;
+        mons[m].width = 0;
+        mons[m].height = 0;
+        mons[m].x = 0;
+        mons[m].y = 0;
+        mons[m].rotation = 0;
+        mons[m].freq = 0.0;
+        mons[m].scale = 1.0;
+        mons[m].interlaced = FALSE;
+        mons[m].primary = FALSE;
+        mons[m].touchscreen = NULL;
+        mons[m].backlight = NULL;
+        mons[m].tmode = MODE_NONE;
+    }
+
+    wm_fn.load_config ();
+
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if ((old[m].modes == NULL) != (mons[m].modes == NULL) || g_strcmp0 (old[m].name, mons[m].name))
+        {
+            // monitors have been added or removed - rebuild the lot
+            for (m = 0; m < MAX_MONS; m++)
+            {
+                g_free (old[m].name);
+                g_free (old[m].touchscreen);
+                g_free (old[m].backlight);
+                g_list_free_full (old[m].modes, g_free);
+            }
+            find_backlights ();
+            sort_modes ();
+            wm_fn.load_touchscreens ();
+            copy_config (mons, bmons);
+            return FALSE;
+        }
+    }
+
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        g_free (mons[m].name);
+        g_list_free_full (mons[m].modes, g_free);
+        mons[m].name = old[m].name;
+        mons[m].modes = old[m].modes;
+        mons[m].touchscreen = old[m].touchscreen;
+        mons[m].backlight = old[m].backlight;
+        mons[m].tmode = old[m].tmode;
+    }
+
+    copy_config (mons, bmons);
+    return TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Hotplug */
+/*----------------------------------------------------------------------------*/
+
+// When a monitor is connected or removed, only its own entry is added to or dropped
+// from the model. Everything else keeps its entry, including any unapplied edits and
+// the settings it would be undone to; an entry may move to a new index if the outputs
+// are reported in a different order.
+
+static void queue_tile (monitor_t *mon)
+{
+    gtk_widget_queue_draw_area (da, SCALE(mon->x) - 1, SCALE(mon->y) - 1,
+        SCALE(screen_w (*mon)) + 2, SCALE(screen_h (*mon)) + 2);
+}
+
+static gboolean hotplug_config (gpointer)
+{
+    monitor_t old[MAX_MONS], oldb[MAX_MONS], oldp[MAX_MONS];
+    char *ts[MAX_MONS];
+    touch_mode_t tmode[MAX_MONS];
+    int from[MAX_MONS];
+    gboolean changed = FALSE, added = FALSE;
+    int m, o;
+
+    hid = 0;
+
+    // the model can't change under an apply, undo or countdown - catch up once it closes
+    if (busy || conf)
+    {
+        hotplugged = TRUE;
+        return FALSE;
+    }
+    hotplugged = FALSE;
+
+    memcpy (old, mons, sizeof (old));
+    memcpy (oldb, bmons, sizeof (oldb));
+    memcpy (oldp, pmons, sizeof (oldp));
+    clear_config (TRUE);
+
+    wm_fn.load_config ();
+
+    // match each output reported now to the entry it had before, by name
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        from[m] = -1;
+        if (mons[m].modes == NULL)
+        {
+            if (old[m].modes) changed = TRUE;
+            continue;
+        }
+        for (o = 0; o < MAX_MONS; o++)
+            if (old[o].modes && !g_strcmp0 (old[o].name, mons[m].name)) from[m] = o;
+        if (from[m] != m) changed = TRUE;
+    }
+
+    if (!changed)
+    {
+        // same outputs as before - an enable or disable, not a hotplug
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            g_free (mons[m].name);
+            g_list_free_full (mons[m].modes, g_free);
+        }
+        memcpy (mons, old, sizeof (old));
+        return FALSE;
+    }
+
+    memset (bmons, 0, sizeof (bmons));
+    memset (pmons, 0, sizeof (pmons));
+
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (from[m] >= 0)
+        {
+            o = from[m];
+            g_free (mons[m].name);
+            g_list_free_full (mons[m].modes, g_free);
+            mons[m] = old[o];
+            bmons[m] = oldb[o];
+            pmons[m] = oldp[o];
+            old[o].modes = NULL;
+        }
+        else if (mons[m].modes)
+        {
+            mons[m].modes = g_list_sort (mons[m].modes, mode_compare);
+            added = TRUE;
+        }
+    }
+
+    // anything not claimed above has been unplugged
+    for (o = 0; o < MAX_MONS; o++)
+    {
+        if (old[o].modes == NULL) continue;
+        queue_tile (&old[o]);
+        g_free (old[o].name);
+        g_free (old[o].touchscreen);
+        g_free (old[o].backlight);
+        g_list_free_full (old[o].modes, g_free);
+        g_free (oldb[o].touchscreen);
+        g_free (oldp[o].touchscreen);
+    }
+
+    if (added)
+    {
+        find_backlights ();
+
+        // look up touchscreen mappings for the new outputs only
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            ts[m] = mons[m].touchscreen;
+            tmode[m] = mons[m].tmode;
+            mons[m].touchscreen = NULL;
+        }
+        wm_fn.load_touchscreens ();
+
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            if (from[m] >= 0)
+            {
+                g_free (mons[m].touchscreen);
+                mons[m].touchscreen = ts[m];
+                mons[m].tmode = tmode[m];
+                continue;
+            }
+
+            // a new output starts with nothing to undo
+            copy_monitor (&mons[m], &bmons[m]);
+            copy_monitor (&mons[m], &pmons[m]);
+            queue_tile (&mons[m]);
+        }
+    }
+
+    curmon = -1;
+    return FALSE;
+}
+
+static void monitors_changed (GdkDisplay *, GdkMonitor *, gpointer)
+{
+    // outputs tend to come and go in bursts as they are probed
+    if (hid) g_source_remove (hid);
+    hid = g_timeout_add (WATCH_DELAY, hotplug_config, NULL);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Drawing */
 /*----------------------------------------------------------------------------*/
@@ -322,19 +575,28 @@ static void check_frequency (int mon)
 {
     GList *model;
     output_mode_t *mode;
+    monitor_t test;
+    float freq = 0.0;
 
-    // set the highest frequency for this mode
+    // set the highest frequency for this mode which fits the display budget
+    test = mons[mon];
     model = mons[mon].modes;
     while (model)
     {
         mode = (output_mode_t *) model->data;
         if (mons[mon].width == mode->width && mons[mon].height == mode->height)
         {
-            mons[mon].freq = mode->freq;
-            return;
+            if (freq == 0.0) freq = mode->freq;
+            test.freq = mode->freq;
+            if (!check_budget (mon, &test))
+            {
+                freq = mode->freq;
+                break;
+            }
         }
         model = model->next;
     }
+    if (freq != 0.0) mons[mon].freq = freq;
 }
 
 static void set_resolution (GtkMenuItem *item, gpointer data)
@@ -351,19 +613,44 @@ static void set_resolution (GtkMenuItem *item, gpointer data)
         mons[mon].width = w;
         mons[mon].height = h;
         mons[mon].interlaced = i;
-        check_frequency (mon);
         mons[mon].scale = 1.0;
+        check_frequency (mon);
     }
     gtk_widget_queue_draw (da);
 }
 
 static void add_resolution (GtkWidget *menu, long mon, int width, int height, gboolean inter)
 {
+    GList *model;
+    output_mode_t *mode;
+    monitor_t test;
+    const char *err = NULL;
+
     char *label = g_strdup_printf ("%dx%d%s", width, height, inter ? "i" : "");
     GtkWidget *item = gtk_check_menu_item_new_with_label (label);
     g_free (label);
     gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (item), mons[mon].width == width && mons[mon].height == height && mons[mon].interlaced == inter);
-    g_signal_connect (item, "activate", G_CALLBACK (set_resolution), (gpointer) mon);
+
+    // usable if any of its frequencies fits the budget
+    test = mons[mon];
+    test.width = width;
+    test.height = height;
+    test.interlaced = inter;
+    test.scale = 1.0;
+    for (model = mons[mon].modes; model; model = model->next)
+    {
+        mode = (output_mode_t *) model->data;
+        if (mode->width != width || mode->height != height || mode->interlaced != inter) continue;
+        test.freq = mode->freq;
+        if (!(err = check_budget (mon, &test))) break;
+    }
+
+    if (err && !gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (item)))
+    {
+        gtk_widget_set_sensitive (item, FALSE);
+        gtk_widget_set_tooltip_text (item, err);
+    }
+    else g_signal_connect (item, "activate", G_CALLBACK (set_resolution), (gpointer) mon);
     gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
 }
 
@@ -375,11 +662,23 @@ static void set_frequency (GtkMenuItem *item, gpointer data)
 
 static void add_frequency (GtkWidget *menu, long mon, float freq)
 {
+    monitor_t test;
+    const char *err;
+
     char *label = g_strdup_printf ("%.3fHz", freq);
     GtkWidget *item = gtk_check_menu_item_new_with_label (label);
     g_free (label);
     gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (item), mons[mon].freq == freq);
-    g_signal_connect (item, "activate", G_CALLBACK (set_frequency), (gpointer) mon);
+
+    test = mons[mon];
+    test.freq = freq;
+    err = check_budget (mon, &test);
+    if (err && mons[mon].freq != freq)
+    {
+        gtk_widget_set_sensitive (item, FALSE);
+        gtk_widget_set_tooltip_text (item, err);
+    }
+    else g_signal_connect (item, "activate", G_CALLBACK (set_frequency), (gpointer) mon);
     gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
 }
 
@@ -392,12 +691,24 @@ static void set_orientation (GtkMenuItem *item, gpointer data)
 
 static void add_orientation (GtkWidget *menu, long mon, const char *orient, int rotation)
 {
+    monitor_t test;
+    const char *err;
+
     GtkWidget *item = gtk_check_menu_item_new_with_label (orient);
     char *tag = g_strdup_printf ("%d", rotation);
     gtk_widget_set_name (item, tag);
     g_free (tag);
     gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (item), mons[mon].rotation == rotation);
-    g_signal_connect (item, "activate", G_CALLBACK (set_orientation), (gpointer) mon);
+
+    test = mons[mon];
+    test.rotation = rotation;
+    err = check_budget (mon, &test);
+    if (err && mons[mon].rotation != rotation)
+    {
+        gtk_widget_set_sensitive (item, FALSE);
+        gtk_widget_set_tooltip_text (item, err);
+    }
+    else g_signal_connect (item, "activate", G_CALLBACK (set_orientation), (gpointer) mon);
     gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
 }
 
@@ -412,6 +723,8 @@ static void add_scaling (GtkWidget *menu, long mon, float scaling)
 {
     float multiplier;
     int wtest, htest;
+    monitor_t test;
+    const char *err;
 
     char *tag = g_strdup_printf ("x %0.1f", scaling);
     GtkWidget *item = gtk_check_menu_item_new_with_label (tag);
@@ -422,10 +735,16 @@ static void add_scaling (GtkWidget *menu, long mon, float scaling)
     multiplier = ceil (scaling) / scaling;
     wtest = mons[mon].width * multiplier;
     htest = mons[mon].height * multiplier;
-    if (wtest > TEXTURE_W || htest > TEXTURE_H)
+    test = mons[mon];
+    test.scale = scaling;
+    if (wtest > TEXTURE_W || htest > TEXTURE_H) err = _("Fractional scalings cannot be used at this resolution");
+    else if (mons[mon].scale != scaling) err = check_budget (mon, &test);
+    else err = NULL;
+
+    if (err)
     {
         gtk_widget_set_sensitive (item, FALSE);
-        gtk_widget_set_tooltip_text (item, _("Fractional scalings cannot be used at this resolution"));
+        gtk_widget_set_tooltip_text (item, err);
     }
     else g_signal_connect (item, "activate", G_CALLBACK (set_scaling), (gpointer) mon);
 
@@ -520,13 +839,23 @@ static GtkWidget *create_menu (long mon)
     float lastf;
     output_mode_t *mode;
     gboolean lasti, show_f = FALSE;
+    monitor_t test;
+    const char *err;
     char *ts;
 
     menu = gtk_menu_new ();
 
     item = gtk_check_menu_item_new_with_label (_("Active"));
     gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (item), mons[mon].enabled);
-    g_signal_connect (item, "activate", G_CALLBACK (set_enable), (gpointer) mon);
+    test = mons[mon];
+    test.enabled = TRUE;
+    err = check_budget (mon, &test);
+    if (err && !mons[mon].enabled)
+    {
+        gtk_widget_set_sensitive (item, FALSE);
+        gtk_widget_set_tooltip_text (item, err);
+    }
+    else g_signal_connect (item, "activate", G_CALLBACK (set_enable), (gpointer) mon);
     gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
 
     if (!mons[mon].enabled)
@@ -704,24 +1033,39 @@ static GtkWidget *create_popup (void)
 
 static void set_timer_msg (void)
 {
-    char *msg;
+    char *msg, *settle, *buf;
     msg = g_strdup_printf (_("Screen updated. Click 'OK' if is this is correct, or 'Cancel' to revert to previous setting.\n\nReverting in %d seconds..."), rev_time);
-    gtk_label_set_text (GTK_LABEL (clbl), msg);
+    if (settle_ms == SETTLE_UNKNOWN) settle = NULL;
+    else if (settle_ms >= 0) settle = g_strdup_printf (_("New settings took effect after %d ms."), settle_ms);
+    else settle = g_strdup (_("New settings did not take effect in the expected time."));
+    buf = settle ? g_strdup_printf ("%s\n\n%s", settle, msg) : g_strdup (msg);
+    gtk_label_set_text (GTK_LABEL (clbl), buf);
     gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (cpb), (10.0 - (float) rev_time) / 10.0);
+    g_free (buf);
+    g_free (settle);
     g_free (msg);
 }
 
 static void handle_cancel (GtkButton *, gpointer)
 {
-    g_source_remove (tid);
+    if (busy)
+    {
+        // still applying - revert as soon as the new settings are in place
+        if (cancellable) g_cancellable_cancel (cancellable);
+        gtk_widget_set_sensitive (ccan, FALSE);
+        return;
+    }
+
+    if (tid) g_source_remove (tid);
+    tid = 0;
     handle_undo (NULL, NULL);
-    gtk_widget_destroy (conf);
 }
 
 static void handle_ok (GtkButton *, gpointer)
 {
-    g_source_remove (tid);
-    gtk_widget_destroy (conf);
+    if (tid) g_source_remove (tid);
+    tid = 0;
+    close_modal ();
 }
 
 static gboolean revert_timeout (gpointer)
@@ -734,12 +1078,19 @@ static gboolean revert_timeout (gpointer)
     }
     else
     {
-        handle_cancel (NULL, NULL);
+        tid = 0;
+        handle_undo (NULL, NULL);
         return FALSE;
     }
 }
 
-static void show_confirm_dialog (void)
+static gboolean pulse_progress (gpointer)
+{
+    gtk_progress_bar_pulse (GTK_PROGRESS_BAR (cpb));
+    return TRUE;
+}
+
+static void show_modal (void)
 {
     GtkBuilder *builder;
 
@@ -750,16 +1101,219 @@ static void show_confirm_dialog (void)
     gtk_window_set_transient_for (GTK_WINDOW (conf), GTK_WINDOW (main_dlg));
     clbl = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
     cpb = (GtkWidget *) gtk_builder_get_object (builder, "modal_pb");
-    g_signal_connect (gtk_builder_get_object (builder, "modal_ok"), "clicked", G_CALLBACK (handle_ok), NULL);
-    g_signal_connect (gtk_builder_get_object (builder, "modal_cancel"), "clicked", G_CALLBACK (handle_cancel), NULL);
+    cok = (GtkWidget *) gtk_builder_get_object (builder, "modal_ok");
+    ccan = (GtkWidget *) gtk_builder_get_object (builder, "modal_cancel");
+    g_signal_connect (cok, "clicked", G_CALLBACK (handle_ok), NULL);
+    g_signal_connect (ccan, "clicked", G_CALLBACK (handle_cancel), NULL);
+    g_signal_connect (conf, "delete-event", G_CALLBACK (gtk_true), NULL);
     gtk_widget_show (conf);
     g_object_unref (builder);
+}
+
+static void close_modal (void)
+{
+    if (pid) g_source_remove (pid);
+    pid = 0;
+    if (conf) gtk_widget_destroy (conf);
+    conf = NULL;
+
+    // pick up any file changes or hotplugs which arrived while the dialog was up
+    if (changes && !wid) wid = g_timeout_add (WATCH_DELAY, refresh_watched, NULL);
+    if (hotplugged && !hid) hid = g_timeout_add (WATCH_DELAY, hotplug_config, NULL);
+}
+
+static void show_progress (const char *msg, gboolean can_cancel)
+{
+    if (!conf) show_modal ();
+
+    gtk_label_set_text (GTK_LABEL (clbl), msg);
+    gtk_widget_set_sensitive (cok, FALSE);
+    gtk_widget_set_sensitive (ccan, can_cancel);
+    if (!pid) pid = g_timeout_add (100, (GSourceFunc) pulse_progress, NULL);
+}
+
+static void show_confirm_dialog (void)
+{
+    if (pid) g_source_remove (pid);
+    pid = 0;
+    if (!conf) show_modal ();
+
+    gtk_widget_set_sensitive (cok, TRUE);
+    gtk_widget_set_sensitive (ccan, TRUE);
 
     rev_time = 10;
     set_timer_msg ();
     tid = g_timeout_add (1000, (GSourceFunc) revert_timeout, NULL);
 }
 
+static void show_failure (void)
+{
+    if (pid) g_source_remove (pid);
+    pid = 0;
+    if (!conf) show_modal ();
+
+    gtk_label_set_text (GTK_LABEL (clbl), _("The screen settings could not be applied, so the previous settings have been kept."));
+    gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (cpb), 0.0);
+    gtk_widget_set_sensitive (cok, TRUE);
+    gtk_widget_set_sensitive (ccan, FALSE);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Apply / undo tasks */
+/*----------------------------------------------------------------------------*/
+
+static void run_task (GTaskThreadFunc func, GAsyncReadyCallback callback)
+{
+    GTask *task;
+
+    busy = TRUE;
+    cancellable = g_cancellable_new ();
+
+    // the thread reports what actually happened, so don't let cancellation override it
+    task = g_task_new (NULL, cancellable, callback, NULL);
+    g_task_set_check_cancellable (task, FALSE);
+    g_task_run_in_thread (task, func);
+    g_object_unref (task);
+}
+
+static gboolean reload_and_settle (monitor_t *expected)
+{
+    gint64 start;
+    wlr_result_t res;
+
+    start = g_get_monotonic_time ();
+
+    if (!wm_fn.reload_config ())
+    {
+        g_warning ("Screen settings were rejected");
+        settle_ms = -1;
+        confirmed = FALSE;
+        return FALSE;
+    }
+    wm_fn.reload_touchscreens ();
+
+    // compositors may apply the change after the reload returns - wait until the
+    // outputs report the expected state, so the refresh reads the new settings
+    res = wm_fn.wait_for_config ? wm_fn.wait_for_config (expected, SETTLE_TIMEOUT) : WLR_UNAVAILABLE;
+    confirmed = res == WLR_APPLIED;
+
+    if (res == WLR_APPLIED)
+    {
+        settle_ms = (g_get_monotonic_time () - start) / 1000;
+        g_message ("Screen settings took effect after %d ms", settle_ms);
+    }
+    else if (res == WLR_UNAVAILABLE)
+    {
+        // nothing to check against, so there is nothing to report
+        settle_ms = SETTLE_UNKNOWN;
+    }
+    else
+    {
+        settle_ms = -1;
+        g_warning ("Screen settings did not take effect within %d ms", SETTLE_TIMEOUT);
+    }
+    return TRUE;
+}
+
+static void apply_thread (GTask *task, gpointer, gpointer, GCancellable *cancel)
+{
+    wm_fn.save_config ();
+    wm_fn.save_touchscreens ();
+
+    if (g_cancellable_is_cancelled (cancel))
+    {
+        // nothing has reached the screen yet - just put the files back
+        wm_fn.revert_config ();
+        wm_fn.revert_touchscreens ();
+        g_task_return_boolean (task, FALSE);
+        return;
+    }
+
+    rejected = !reload_and_settle (mons);
+    g_task_return_boolean (task, TRUE);
+}
+
+static void apply_done (GObject *, GAsyncResult *res, gpointer)
+{
+    gboolean applied, cancelled;
+
+    applied = g_task_propagate_boolean (G_TASK (res), NULL);
+    cancelled = g_cancellable_is_cancelled (cancellable);
+    busy = FALSE;
+    g_clear_object (&cancellable);
+
+    if (!applied)
+    {
+        close_modal ();
+        return;
+    }
+
+    if (rejected)
+    {
+        // the new layout never reached the screen - put the files back, then say so
+        failed = TRUE;
+        handle_undo (NULL, NULL);
+        return;
+    }
+
+    refresh_config ();
+
+    gtk_widget_queue_draw (da);
+    gtk_widget_set_sensitive (undo, TRUE);
+
+    // the countdown only starts once the new settings are actually on screen
+    if (cancelled) handle_undo (NULL, NULL);
+    else show_confirm_dialog ();
+}
+
+static void undo_thread (GTask *task, gpointer, gpointer, GCancellable *)
+{
+    wm_fn.revert_config ();
+    wm_fn.revert_touchscreens ();
+
+    reload_and_settle (mons);
+    g_task_return_boolean (task, TRUE);
+}
+
+static void undo_done (GObject *, GAsyncResult *res, gpointer)
+{
+    int m;
+
+    g_task_propagate_boolean (G_TASK (res), NULL);
+    busy = FALSE;
+    g_clear_object (&cancellable);
+
+    if (confirmed)
+    {
+        // the outputs reported exactly the restored layout - no need to probe them again
+        copy_config (mons, bmons);
+    }
+    else if (refresh_config ())
+    {
+        // the touchscreen mappings are the ones from before the last apply
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            g_free (mons[m].touchscreen);
+            mons[m].touchscreen = g_strdup (pmons[m].touchscreen);
+            mons[m].tmode = pmons[m].tmode;
+        }
+        copy_config (mons, bmons);
+    }
+
+    gtk_widget_queue_draw (da);
+    gtk_widget_set_sensitive (undo, FALSE);
+
+    if (failed) show_failure ();
+    else close_modal ();
+    failed = FALSE;
+}
+
+static void wait_for_task (void)
+{
+    while (busy) gtk_main_iteration ();
+}
+
 /*----------------------------------------------------------------------------*/
 /* Touchscreens */
 /*----------------------------------------------------------------------------*/
@@ -814,7 +1368,7 @@ static void find_backlights (void)
                     {
                         for (m = 0; m < MAX_MONS; m++)
                         {
-                            if (mons[m].modes == NULL) continue;
+                            if (mons[m].modes == NULL || mons[m].backlight) continue;
                             if (!g_strcmp0 (mons[m].name, buffer))
                             {
                                 mons[m].backlight = g_strdup (entry->d_name);
@@ -995,49 +1549,24 @@ static void gesture_end (GtkGestureLongPress *, GdkEventSequence *, gpointer)
 
 static void handle_apply (GtkButton *, gpointer)
 {
-    if (compare_config (mons, bmons)) return;
-
-    wm_fn.save_config ();
-    wm_fn.save_touchscreens ();
+    if (busy || compare_config (mons, bmons)) return;
 
-    wm_fn.reload_config ();
-    wm_fn.reload_touchscreens ();
-
-    clear_config (FALSE);
-
-    wm_fn.load_config ();
+    // remember the settings being replaced, for undo
+    copy_config (bmons, pmons);
 
-    find_backlights ();
-    sort_modes ();
-    copy_config (mons, bmons);
-
-    wm_fn.load_touchscreens ();
-
-    gtk_widget_queue_draw (da);
-    gtk_widget_set_sensitive (undo, TRUE);
-    show_confirm_dialog ();
+    show_progress (_("Applying screen settings..."), TRUE);
+    run_task (apply_thread, apply_done);
 }
 
 static void handle_undo (GtkButton *, gpointer)
 {
-    wm_fn.revert_config ();
-    wm_fn.revert_touchscreens ();
-
-    wm_fn.reload_config ();
-    wm_fn.reload_touchscreens ();
-
-    clear_config (FALSE);
-
-    wm_fn.load_config ();
-
-    find_backlights ();
-    sort_modes ();
-    copy_config (mons, bmons);
+    if (busy) return;
 
-    wm_fn.load_touchscreens ();
+    // backends that push the layout live apply the model, so put that back too
+    copy_config (pmons, mons);
 
-    gtk_widget_queue_draw (da);
-    gtk_widget_set_sensitive (undo, FALSE);
+    show_progress (_("Restoring previous screen settings..."), FALSE);
+    run_task (undo_thread, undo_done);
 }
 
 static void handle_zoom (GtkButton *, gpointer data)
@@ -1139,6 +1668,97 @@ static void handle_ident (GtkButton *, gpointer)
     identify_monitors ();
 }
 
+/*----------------------------------------------------------------------------*/
+/* File monitoring */
+/*----------------------------------------------------------------------------*/
+
+// The files each backend reads its state from are watched, so changes made by other
+// tools show up straight away. Only the part of the model which comes from the changed
+// file is refreshed, by parsing that file; the parse cache means any other file it reads
+// is not parsed again. A backend only watches its layout file if it can parse it - the
+// kanshi config is not watched, as kanshi itself doesn't act on an edit to it.
+
+static void refresh_touchscreens (void)
+{
+    int m;
+
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        g_free (mons[m].touchscreen);
+        mons[m].touchscreen = NULL;
+        mons[m].tmode = MODE_NONE;
+    }
+    wm_fn.load_touchscreens ();
+}
+
+static gboolean refresh_watched (gpointer)
+{
+    wid = 0;
+
+    // keep the change until apply or undo is finished and there are no unapplied edits -
+    // close_modal re-arms the refresh
+    if (busy || conf || !compare_config (mons, bmons)) return FALSE;
+
+    if ((changes & WATCH_LAYOUT) && wm_fn.load_config_file) wm_fn.load_config_file ();
+    if (changes & WATCH_TOUCH) refresh_touchscreens ();
+    changes = 0;
+
+    copy_config (mons, bmons);
+    gtk_widget_queue_draw (da);
+    return FALSE;
+}
+
+static void file_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer data)
+{
+    // config files are usually replaced by a rename, which is reported as a create
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT && event != G_FILE_MONITOR_EVENT_CREATED) return;
+
+    // editors and tools often write more than once - wait for them to finish
+    changes |= (long) data;
+    if (wid) g_source_remove (wid);
+    wid = g_timeout_add (WATCH_DELAY, refresh_watched, NULL);
+}
+
+static void watch_files (void)
+{
+    char *files[2];
+    GFile *file;
+    long flags;
+    int i;
+
+    files[0] = wm_fn.config_file && wm_fn.load_config_file ? wm_fn.config_file () : NULL;
+    files[1] = wm_fn.touch_file ? wm_fn.touch_file () : NULL;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (!files[i]) continue;
+
+        // one monitor if both come from the same file
+        flags = i ? WATCH_TOUCH : WATCH_LAYOUT;
+        if (!i && !g_strcmp0 (files[0], files[1]))
+        {
+            flags |= WATCH_TOUCH;
+            g_free (files[1]);
+            files[1] = NULL;
+        }
+
+        file = g_file_new_for_path (files[i]);
+        watches[i] = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+        if (watches[i]) g_signal_connect (watches[i], "changed", G_CALLBACK (file_changed), (gpointer) flags);
+        g_object_unref (file);
+        g_free (files[i]);
+    }
+}
+
+static void unwatch_files (void)
+{
+    int i;
+
+    if (wid) g_source_remove (wid);
+    wid = 0;
+    for (i = 0; i < 2; i++) g_clear_object (&watches[i]);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Load / save config */
 /*----------------------------------------------------------------------------*/
@@ -1191,6 +1811,23 @@ static void save_scale (void)
     g_free (conffile);
 }
 
+static void update_system (void)
+{
+    monitor_t applied[MAX_MONS];
+    int m;
+
+    // the system copy is the last layout applied and confirmed, not any edits made since
+    // - the snapshot only holds the settings, so borrow the rest from the model
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        applied[m] = bmons[m];
+        applied[m].name = mons[m].name;
+        applied[m].modes = mons[m].modes;
+        applied[m].backlight = mons[m].backlight;
+    }
+    wm_fn.update_system_config (applied);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Initial configuration                                                      */
 /*----------------------------------------------------------------------------*/
@@ -1205,13 +1842,21 @@ static void init_config (void)
 
     find_backlights ();
     sort_modes ();
-    copy_config (mons, bmons);
 
     wm_fn.load_touchscreens ();
 
+    copy_config (mons, bmons);
+
+    init_budget ();
+
     // ensure the config file reflects the current state, or undo won't work...
     wm_fn.init_config ();
 
+    watch_files ();
+
+    g_signal_connect (gdk_display_get_default (), "monitor-added", G_CALLBACK (monitors_changed), NULL);
+    g_signal_connect (gdk_display_get_default (), "monitor-removed", G_CALLBACK (monitors_changed), NULL);
+
     curmon = -1;
     da = (GtkWidget *) gtk_builder_get_object (builder, "da");
     gtk_widget_set_events (da, GDK_POINTER_MOTION_MASK | GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_SCROLL_MASK);
@@ -1325,13 +1970,19 @@ gboolean reboot_needed (void)
 {
     save_scale ();
 
-    if (gtk_widget_get_sensitive (undo)) wm_fn.update_system_config ();
-    // note - if you change a touchscreen under wayfire you do need to reboot, but ...
+    wait_for_task ();
+    if (gtk_widget_get_sensitive (undo)) update_system ();
+    // note - touchscreen changes under wayfire are applied live through its IPC plugin;
+    // without it they only take effect when wayfire restarts, but ...
     return FALSE;
 }
 
 void free_plugin (void)
 {
+    unwatch_files ();
+    g_signal_handlers_disconnect_by_func (gdk_display_get_default (), monitors_changed, NULL);
+    if (hid) g_source_remove (hid);
+    hid = 0;
     g_object_unref (builder);
 }
 
@@ -1343,13 +1994,15 @@ void free_plugin (void)
 
 static void handle_close (GtkButton *, gpointer)
 {
-    if (gtk_widget_get_sensitive (undo)) wm_fn.update_system_config ();
+    wait_for_task ();
+    if (gtk_widget_get_sensitive (undo)) update_system ();
     gtk_main_quit ();
 }
 
 static void close_prog (GtkWidget *, GdkEvent *, gpointer)
 {
-    if (gtk_widget_get_sensitive (undo)) wm_fn.update_system_config ();
+    wait_for_task ();
+    if (gtk_widget_get_sensitive (undo)) update_system ();
     gtk_main_quit ();
 }
 
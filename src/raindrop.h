@@ -53,6 +53,18 @@ typedef enum {
     MODE_NONE
 } touch_mode_t;
 
+typedef struct {
+    char *device;
+    char *output;
+    touch_mode_t mode;
+} touch_map_t;
+
+typedef enum {
+    WLR_UNAVAILABLE,
+    WLR_APPLIED,
+    WLR_FAILED
+} wlr_result_t;
+
 typedef struct {
     int width;
     int height;
@@ -84,12 +96,16 @@ typedef struct {
     void (*load_touchscreens) (void);
     void (*save_config) (void);
     void (*save_touchscreens) (void);
-    void (*reload_config) (void);
+    gboolean (*reload_config) (void);
     void (*reload_touchscreens) (void);
     void (*revert_config) (void);
     void (*revert_touchscreens) (void);
-    void (*update_system_config) (void);
+    void (*update_system_config) (monitor_t *applied);
     void (*identify_monitors) (void);
+    wlr_result_t (*wait_for_config) (monitor_t *expected, int timeout);
+    char *(*config_file) (void);
+    void (*load_config_file) (void);
+    char *(*touch_file) (void);
 } wm_functions_t;
 
 /*----------------------------------------------------------------------------*/
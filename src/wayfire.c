@@ -25,13 +25,29 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
-#include <locale.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <gtk/gtk.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "raindrop.h"
 
+// replies to the few calls made here are small - anything bigger is a broken stream
+#define IPC_MAX_REPLY (1024 * 1024)
+
 extern void load_labwc_config (void);
+extern void free_touch_maps (GList *maps);
 extern void noop (void);
+extern gboolean write_atomic (const char *filename, const char *data, gsize len);
+extern gboolean copy_file (const char *src, const char *dst);
+extern gboolean backup_file (const char *filename, const char *backup);
+extern gboolean restore_file (const char *backup, const char *filename);
+extern void install_system_files (const char **files);
+extern wlr_result_t wlr_wait_for_config (monitor_t *expected, int timeout);
+extern gboolean cache_lookup (const char *filename, gpointer *data, GStatBuf *st);
+extern void cache_store (const char *filename, const GStatBuf *st, gpointer data, GDestroyNotify free_func);
 
 /*----------------------------------------------------------------------------*/
 /* Global data */
@@ -43,110 +59,542 @@ extern const char *orients[4];
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
-void update_wayfire_system_config (void);
+void update_wayfire_system_config (monitor_t *);
+static char *line_group (const char *line);
+static gboolean line_key (const char *line, const char *key, const char **value);
+static void ini_set (GPtrArray *lines, const char *group, const char *key, const char *value);
+static void update_wayfire_ini (char *filename);
 void save_wayfire_config (void);
 void revert_wayfire_config (void);
+static char *json_escape (const char *str);
+static int json_hex (const char *str);
+static char *json_string (const char *str);
+static char *json_member (const char *obj, const char *key);
+static int ipc_connect (void);
+static gboolean ipc_write (int fd, const char *buf, gsize len);
+static gboolean ipc_read (int fd, char *buf, gsize len);
+static char *ipc_call (int fd, const char *method, const char *data);
+static gboolean ipc_set_options (int fd, const char *options);
+static gboolean ipc_check_option (int fd, const char *option, const char *value);
+gboolean reload_wayfire_config (void);
+void reload_wayfire_touchscreens (void);
+static GList *parse_wayfire_touchscreens (const char *filename);
 void load_wayfire_touchscreens (void);
+char *wayfire_config_file (void);
+void load_wayfire_layout (void);
 
 /*----------------------------------------------------------------------------*/
 /* System update */
 /*----------------------------------------------------------------------------*/
 
-void update_wayfire_system_config (void)
+void update_wayfire_system_config (monitor_t *)
 {
-    system (SUDO_PREFIX "cp /tmp/greeter.ini /usr/share/greeter.ini");
+    const char *files[] = { "/tmp/greeter.ini", "/usr/share/greeter.ini", NULL };
+    install_system_files (files);
 }
 
 /*----------------------------------------------------------------------------*/
 /* Writing config */
 /*----------------------------------------------------------------------------*/
 
+// wayfire reloads its plugins whenever the ini file changes, so rather than
+// regenerating the file, only the lines holding values which differ are touched
+
+static char *line_group (const char *line)
+{
+    const char *start, *end;
+
+    start = line;
+    while (g_ascii_isspace (*start)) start++;
+    if (*start != '[') return NULL;
+    end = strchr (start, ']');
+    if (!end) return NULL;
+    return g_strndup (start + 1, end - start - 1);
+}
+
+static gboolean line_key (const char *line, const char *key, const char **value)
+{
+    const char *ptr, *eq;
+    int len;
+
+    ptr = line;
+    while (g_ascii_isspace (*ptr)) ptr++;
+    if (*ptr == '#' || *ptr == ';') return FALSE;
+
+    eq = strchr (ptr, '=');
+    if (!eq) return FALSE;
+
+    len = eq - ptr;
+    while (len && g_ascii_isspace (ptr[len - 1])) len--;
+    if (len != strlen (key) || strncmp (ptr, key, len)) return FALSE;
+
+    eq++;
+    while (*eq == ' ' || *eq == '\t') eq++;
+    *value = eq;
+    return TRUE;
+}
+
+static void ini_set (GPtrArray *lines, const char *group, const char *key, const char *value)
+{
+    char *grp, *line, *tmp;
+    const char *val, *ptr;
+    gboolean changed;
+    int i, start = -1, last = -1;
+
+    // find the group, and the key within it
+    for (i = 0; i < lines->len; i++)
+    {
+        line = g_ptr_array_index (lines, i);
+        grp = line_group (line);
+        if (grp)
+        {
+            if (start != -1)
+            {
+                g_free (grp);
+                break;
+            }
+            if (!g_strcmp0 (grp, group)) start = last = i;
+            g_free (grp);
+            continue;
+        }
+        if (start == -1) continue;
+
+        if (line_key (line, key, &val))
+        {
+            // leave the line exactly as it was if the value is the same
+            tmp = g_strchomp (g_strdup (val));
+            changed = g_strcmp0 (tmp, value) != 0;
+            g_free (tmp);
+            if (changed)
+            {
+                g_ptr_array_index (lines, i) = g_strdup_printf ("%.*s%s", (int) (val - line), line, value);
+                g_free (line);
+            }
+            return;
+        }
+        // new keys go after the last non-blank line of the group
+        for (ptr = line; g_ascii_isspace (*ptr); ptr++);
+        if (*ptr) last = i;
+    }
+
+    if (start == -1)
+    {
+        // new group at the end of the file
+        if (lines->len && *((char *) g_ptr_array_index (lines, lines->len - 1)))
+            g_ptr_array_add (lines, g_strdup (""));
+        g_ptr_array_add (lines, g_strdup_printf ("[%s]", group));
+        g_ptr_array_add (lines, g_strdup_printf ("%s=%s", key, value));
+    }
+    else g_ptr_array_insert (lines, last + 1, g_strdup_printf ("%s=%s", key, value));
+}
+
 static void update_wayfire_ini (char *filename)
 {
-    GKeyFile *kf;
-    char *grp, *set;
-    int m;
+    GPtrArray *lines;
+    GString *out;
+    char *data, *grp, *set, **split;
+    gsize len;
+    int i, m;
+
+    if (!g_file_get_contents (filename, &data, &len, NULL))
+    {
+        data = g_strdup ("");
+        len = 0;
+    }
+
+    // the last element is whatever follows the final newline - usually nothing
+    split = g_strsplit (data, "\n", -1);
+    lines = g_ptr_array_new_with_free_func (g_free);
+    for (i = 0; split[i]; i++) g_ptr_array_add (lines, split[i]);
+    g_free (split);
+    if (lines->len && !*((char *) g_ptr_array_index (lines, lines->len - 1)))
+        g_ptr_array_remove_index (lines, lines->len - 1);
 
-    kf = g_key_file_new ();
-    g_key_file_load_from_file (kf, filename, G_KEY_FILE_KEEP_COMMENTS, NULL);
-    
     for (m = 0; m < MAX_MONS; m++)
     {
         if (mons[m].modes == NULL) continue;
         grp = g_strdup_printf ("output:%s", mons[m].name);
-        g_key_file_remove_group (kf, grp, NULL);
         if (mons[m].enabled)
         {
             set = g_strdup_printf ("%dx%d@%d", mons[m].width, mons[m].height, (int)((mons[m].freq + 0.0005) * 1000.0));
-            g_key_file_set_string (kf, grp, "mode", set);
+            ini_set (lines, grp, "mode", set);
             g_free (set);
 
             set = g_strdup_printf ("%d,%d", mons[m].x, mons[m].y);
-            g_key_file_set_string (kf, grp, "position", set);
+            ini_set (lines, grp, "position", set);
             g_free (set);
-            
-            g_key_file_set_string (kf, grp, "transform", orients[mons[m].rotation / 90]);
+
+            ini_set (lines, grp, "transform", orients[mons[m].rotation / 90]);
         }
-        else g_key_file_set_string (kf, grp, "mode", "off");
-        
+        else ini_set (lines, grp, "mode", "off");
+
         if (mons[m].touchscreen)
         {
             set = g_strdup_printf ("input-device:%s", mons[m].touchscreen);
-            g_key_file_set_string (kf, set, "output", mons[m].name);
+            ini_set (lines, set, "output", mons[m].name);
             g_free (set);
         }
         g_free (grp);
     }
 
-    g_key_file_save_to_file (kf, filename, NULL);
-    g_key_file_free (kf);
+    out = g_string_sized_new (len + 256);
+    for (i = 0; i < lines->len; i++)
+    {
+        g_string_append (out, g_ptr_array_index (lines, i));
+        g_string_append_c (out, '\n');
+    }
+
+    // nothing changed - don't touch the file, so wayfire doesn't reload
+    if (out->len != len || memcmp (out->str, data, len))
+        write_atomic (filename, out->str, out->len);
+
+    g_string_free (out, TRUE);
+    g_ptr_array_free (lines, TRUE);
+    g_free (data);
 }
 
 void save_wayfire_config (void)
 {
-    char *infile, *outfile, *cmd;
+    char *infile, *outfile;
 
     infile = g_build_filename (g_get_user_config_dir (), "wayfire.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "wayfire.ini", NULL);
 
-    cmd = g_strdup_printf ("test -f %s", outfile);
-    if (system (cmd))
-    {
-        g_free (cmd);
-        cmd = g_strdup_printf ("cp /etc/wayfire/template.ini %s", outfile);
-        system (cmd);
-    }
-    g_free (cmd);
+    if (!g_file_test (outfile, G_FILE_TEST_IS_REGULAR))
+        copy_file ("/etc/wayfire/template.ini", outfile);
 
-    cmd = g_strdup_printf ("cp %s %s", outfile, infile);
-    system (cmd);
+    backup_file (outfile, infile);
     g_free (infile);
-    g_free (cmd);
 
     update_wayfire_ini (outfile);
     g_free (outfile);
 
-    if (system ("test -f /usr/share/greeter.ini"))
-        system ("cp /etc/wayfire/gtemplate.ini /tmp/greeter.ini");
+    if (!g_file_test ("/usr/share/greeter.ini", G_FILE_TEST_IS_REGULAR))
+        copy_file ("/etc/wayfire/gtemplate.ini", "/tmp/greeter.ini");
     else
-        system ("cp /usr/share/greeter.ini /tmp/greeter.ini");
+        copy_file ("/usr/share/greeter.ini", "/tmp/greeter.ini");
 
     update_wayfire_ini ("/tmp/greeter.ini");
 }
 
+/*----------------------------------------------------------------------------*/
+/* IPC */
+/*----------------------------------------------------------------------------*/
+
+// Messages on the wayfire IPC socket are a native-endian 32-bit length followed
+// by that many bytes of JSON, with each request getting exactly one reply.
+
+// Quote a string for use inside a JSON string literal; UTF-8 passes through as-is
+
+static char *json_escape (const char *str)
+{
+    GString *res = g_string_sized_new (strlen (str));
+
+    for (; *str; str++)
+    {
+        switch (*str)
+        {
+            case '"' :  g_string_append (res, "\\\"");
+                        break;
+            case '\\' : g_string_append (res, "\\\\");
+                        break;
+            case '\n' : g_string_append (res, "\\n");
+                        break;
+            case '\r' : g_string_append (res, "\\r");
+                        break;
+            case '\t' : g_string_append (res, "\\t");
+                        break;
+            default :   if ((guchar) *str < 0x20) g_string_append_printf (res, "\\u%04x", (guchar) *str);
+                        else g_string_append_c (res, *str);
+                        break;
+        }
+    }
+    return g_string_free (res, FALSE);
+}
+
+// Read the JSON string literal which starts at the opening quote in str, returning it
+// unescaped, or NULL if it is malformed
+
+static int json_hex (const char *str)
+{
+    int i, val = 0;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (!g_ascii_isxdigit (str[i])) return -1;
+        val = val * 16 + g_ascii_xdigit_value (str[i]);
+    }
+    return val;
+}
+
+static char *json_string (const char *str)
+{
+    GString *res;
+    gboolean ok = TRUE;
+    int ch, lo;
+
+    if (*str++ != '"') return NULL;
+    res = g_string_new (NULL);
+
+    while (ok && *str != '"')
+    {
+        if ((guchar) *str < 0x20) ok = FALSE;
+        else if (*str != '\\') g_string_append_c (res, *str);
+        else switch (*++str)
+        {
+            case '"' :
+            case '\\' :
+            case '/' :  g_string_append_c (res, *str);
+                        break;
+            case 'b' :  g_string_append_c (res, '\b');
+                        break;
+            case 'f' :  g_string_append_c (res, '\f');
+                        break;
+            case 'n' :  g_string_append_c (res, '\n');
+                        break;
+            case 'r' :  g_string_append_c (res, '\r');
+                        break;
+            case 't' :  g_string_append_c (res, '\t');
+                        break;
+            case 'u' :  ch = json_hex (str + 1);
+                        if (ch < 0)
+                        {
+                            ok = FALSE;
+                            break;
+                        }
+                        str += 4;
+                        // characters outside the BMP come as a pair of surrogates
+                        if (ch >= 0xD800 && ch < 0xDC00 && str[1] == '\\' && str[2] == 'u')
+                        {
+                            lo = json_hex (str + 3);
+                            if (lo >= 0xDC00 && lo < 0xE000)
+                            {
+                                ch = 0x10000 + ((ch - 0xD800) << 10) + (lo - 0xDC00);
+                                str += 6;
+                            }
+                        }
+                        if (ch >= 0xD800 && ch < 0xE000) ok = FALSE;
+                        else g_string_append_unichar (res, ch);
+                        break;
+            default :   ok = FALSE;
+                        break;
+        }
+        if (ok) str++;
+    }
+    return g_string_free (res, !ok);
+}
+
+// Find a string member of a JSON object by key, allowing for any whitespace the
+// sender puts around the colon, and return its value unescaped
+
+static char *json_member (const char *obj, const char *key)
+{
+    char *name, *val;
+    const char *ptr;
+
+    name = g_strdup_printf ("\"%s\"", key);
+    for (ptr = strstr (obj, name); ptr; ptr = strstr (ptr + 1, name))
+    {
+        val = (char *) ptr + strlen (name);
+        while (g_ascii_isspace (*val)) val++;
+        if (*val++ != ':') continue;
+        while (g_ascii_isspace (*val)) val++;
+        g_free (name);
+        return json_string (val);
+    }
+    g_free (name);
+    return NULL;
+}
+
+static int ipc_connect (void)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    int fd;
+
+    path = g_getenv ("WAYFIRE_SOCKET");
+    if (!path || strlen (path) >= sizeof (addr.sun_path)) return -1;
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+static gboolean ipc_write (int fd, const char *buf, gsize len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = write (fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static gboolean ipc_read (int fd, char *buf, gsize len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = read (fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static char *ipc_call (int fd, const char *method, const char *data)
+{
+    char *msg, *reply;
+    guint32 len;
+
+    msg = g_strdup_printf ("{\"method\":\"%s\",\"data\":%s}", method, data);
+    len = strlen (msg);
+    if (!ipc_write (fd, (char *) &len, sizeof (len)) || !ipc_write (fd, msg, len))
+    {
+        g_free (msg);
+        return NULL;
+    }
+    g_free (msg);
+
+    if (!ipc_read (fd, (char *) &len, sizeof (len)) || len > IPC_MAX_REPLY) return NULL;
+    reply = g_malloc (len + 1);
+    if (!ipc_read (fd, reply, len))
+    {
+        g_free (reply);
+        return NULL;
+    }
+    reply[len] = 0;
+    return reply;
+}
+
+static gboolean ipc_set_options (int fd, const char *options)
+{
+    char *reply;
+    gboolean res;
+
+    reply = ipc_call (fd, "wayfire/set-config-options", options);
+    res = reply && strstr (reply, "\"error\"") == NULL;
+    g_free (reply);
+    return res;
+}
+
+static gboolean ipc_check_option (int fd, const char *option, const char *value)
+{
+    char *data, *reply, *val = NULL;
+    gboolean res;
+
+    // option goes into the request so is already escaped; value is compared as-is
+    data = g_strdup_printf ("{\"option\":\"%s\"}", option);
+    reply = ipc_call (fd, "wayfire/get-config-option", data);
+    if (reply) val = json_member (reply, "value");
+    res = !g_strcmp0 (val, value);
+    g_free (val);
+    g_free (reply);
+    g_free (data);
+    return res;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Reload / reversion */
 /*----------------------------------------------------------------------------*/
 
+gboolean reload_wayfire_config (void)
+{
+    GString *opts;
+    char *name;
+    int fd, m;
+    gboolean res = TRUE;
+
+    // without the IPC plugin, wayfire picks up the rewritten ini file by itself
+    fd = ipc_connect ();
+    if (fd < 0) return TRUE;
+
+    // set each output separately, so a rejected one doesn't hold up the others
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL) continue;
+
+        name = json_escape (mons[m].name);
+        opts = g_string_new ("{");
+        if (mons[m].enabled)
+        {
+            g_string_append_printf (opts, "\"output:%s/mode\":\"%dx%d@%d\",", name,
+                mons[m].width, mons[m].height, (int)((mons[m].freq + 0.0005) * 1000.0));
+            g_string_append_printf (opts, "\"output:%s/position\":\"%d,%d\",", name, mons[m].x, mons[m].y);
+            g_string_append_printf (opts, "\"output:%s/transform\":\"%s\"", name, orients[mons[m].rotation / 90]);
+        }
+        else g_string_append_printf (opts, "\"output:%s/mode\":\"off\"", name);
+        g_string_append (opts, "}");
+
+        if (!ipc_set_options (fd, opts->str))
+        {
+            g_warning ("wayfire did not accept the settings for %s", mons[m].name);
+            res = FALSE;
+        }
+
+        g_string_free (opts, TRUE);
+        g_free (name);
+    }
+
+    close (fd);
+    return res;
+}
+
+void reload_wayfire_touchscreens (void)
+{
+    char *opt, *ts, *name, *set;
+    int fd, m;
+
+    // without the IPC plugin, the input-device groups in the ini only apply on restart
+    fd = ipc_connect ();
+    if (fd < 0) return;
+
+    for (m = 0; m < MAX_MONS; m++)
+    {
+        if (mons[m].modes == NULL || mons[m].touchscreen == NULL) continue;
+
+        ts = json_escape (mons[m].touchscreen);
+        name = json_escape (mons[m].name);
+        opt = g_strdup_printf ("input-device:%s/output", ts);
+        set = g_strdup_printf ("{\"%s\":\"%s\"}", opt, name);
+
+        // read the option back to confirm the mapping is live
+        if (!ipc_set_options (fd, set) || !ipc_check_option (fd, opt, mons[m].name))
+            g_warning ("wayfire did not map touchscreen %s to %s", mons[m].touchscreen, mons[m].name);
+
+        g_free (set);
+        g_free (opt);
+        g_free (name);
+        g_free (ts);
+    }
+
+    close (fd);
+}
+
 void revert_wayfire_config (void)
 {
-    char *infile, *outfile, *cmd;
+    char *infile, *outfile;
 
     infile = g_build_filename (g_get_user_config_dir (), "wayfire.bak", NULL);
     outfile = g_build_filename (g_get_user_config_dir (), "wayfire.ini", NULL);
-    cmd = g_strdup_printf ("cp %s %s", infile, outfile);
-    system (cmd);
-    g_free (cmd);
+    restore_file (infile, outfile);
     g_free (infile);
     g_free (outfile);
 }
@@ -155,21 +603,19 @@ void revert_wayfire_config (void)
 /* Touchscreens */
 /*----------------------------------------------------------------------------*/
 
-void load_wayfire_touchscreens (void)
+static GList *parse_wayfire_touchscreens (const char *filename)
 {
     GKeyFile *kf;
     GError *err;
-    char *infile;
     gchar **grps, *mon;
-    int i, m;
-    gsize ngrps;
-
-    infile = g_build_filename (g_get_user_config_dir (), "wayfire.ini", NULL);
+    touch_map_t *map;
+    GList *maps = NULL;
+    gsize i, ngrps;
 
     kf = g_key_file_new ();
 
     err = NULL;
-    g_key_file_load_from_file (kf, infile, G_KEY_FILE_KEEP_COMMENTS, &err);
+    g_key_file_load_from_file (kf, filename, G_KEY_FILE_KEEP_COMMENTS, &err);
     if (!err)
     {
         grps = g_key_file_get_groups (kf, &ngrps);
@@ -183,16 +629,12 @@ void load_wayfire_touchscreens (void)
 
                 if (!err)
                 {
-                    for (m = 0; m < MAX_MONS; m++)
-                    {
-                        if (mons[m].modes == NULL) continue;
-                        if (!g_strcmp0 (mon, mons[m].name))
-                            mons[m].touchscreen = g_strdup (grps[i] + 13);
-                    }
+                    map = g_new0 (touch_map_t, 1);
+                    map->device = g_strdup (grps[i] + 13);
+                    map->output = mon;
+                    maps = g_list_prepend (maps, map);
                 }
                 else g_error_free (err);
-
-                g_free (mon);
             }
         }
 
@@ -200,6 +642,101 @@ void load_wayfire_touchscreens (void)
     }
     else g_error_free (err);
 
+    g_key_file_free (kf);
+    return g_list_reverse (maps);
+}
+
+void load_wayfire_touchscreens (void)
+{
+    GList *maps, *ptr;
+    touch_map_t *map;
+    GStatBuf st;
+    char *infile;
+    int m;
+
+    infile = g_build_filename (g_get_user_config_dir (), "wayfire.ini", NULL);
+
+    // only re-read when the file has changed since it was last parsed
+    if (!cache_lookup (infile, (gpointer *) &maps, &st))
+    {
+        maps = parse_wayfire_touchscreens (infile);
+        cache_store (infile, &st, maps, (GDestroyNotify) free_touch_maps);
+    }
+
+    for (ptr = maps; ptr; ptr = ptr->next)
+    {
+        map = (touch_map_t *) ptr->data;
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            if (!g_strcmp0 (map->output, mons[m].name))
+                mons[m].touchscreen = g_strdup (map->device);
+        }
+    }
+
+    g_free (infile);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Watched files */
+/*----------------------------------------------------------------------------*/
+
+char *wayfire_config_file (void)
+{
+    // outputs and touchscreens are both in the one file
+    return g_build_filename (g_get_user_config_dir (), "wayfire.ini", NULL);
+}
+
+void load_wayfire_layout (void)
+{
+    GKeyFile *kf;
+    char *infile, *grp, *val;
+    int m, i, w, h, r, x, y;
+
+    // read the layout back from the file, rather than probing wayfire, which may not
+    // have picked the change up yet
+    infile = wayfire_config_file ();
+    kf = g_key_file_new ();
+    if (g_key_file_load_from_file (kf, infile, G_KEY_FILE_NONE, NULL))
+    {
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            grp = g_strdup_printf ("output:%s", mons[m].name);
+
+            if ((val = g_key_file_get_string (kf, grp, "mode", NULL)))
+            {
+                if (!g_strcmp0 (val, "off")) mons[m].enabled = FALSE;
+                else if (sscanf (val, "%dx%d@%d", &w, &h, &r) == 3)
+                {
+                    mons[m].enabled = TRUE;
+                    mons[m].width = w;
+                    mons[m].height = h;
+                    mons[m].freq = r / 1000.0;
+                }
+                g_free (val);
+            }
+
+            if ((val = g_key_file_get_string (kf, grp, "position", NULL)))
+            {
+                if (sscanf (val, "%d,%d", &x, &y) == 2)
+                {
+                    mons[m].x = x;
+                    mons[m].y = y;
+                }
+                g_free (val);
+            }
+
+            if ((val = g_key_file_get_string (kf, grp, "transform", NULL)))
+            {
+                for (i = 0; i < 4; i++)
+                    if (!g_strcmp0 (val, orients[i])) mons[m].rotation = i * 90;
+                g_free (val);
+            }
+
+            g_free (grp);
+        }
+    }
     g_key_file_free (kf);
     g_free (infile);
 }
@@ -214,11 +751,15 @@ wm_functions_t wayfire_functions = {
     .load_touchscreens = load_wayfire_touchscreens,
     .save_config = save_wayfire_config,
     .save_touchscreens = noop,
-    .reload_config = noop,
-    .reload_touchscreens = noop,
+    .reload_config = reload_wayfire_config,
+    .reload_touchscreens = reload_wayfire_touchscreens,
     .revert_config = revert_wayfire_config,
     .revert_touchscreens = noop,
-    .update_system_config = update_wayfire_system_config
+    .update_system_config = update_wayfire_system_config,
+    .wait_for_config = wlr_wait_for_config,
+    .config_file = wayfire_config_file,
+    .load_config_file = load_wayfire_layout,
+    .touch_file = wayfire_config_file
 };
 
 /* End of file */
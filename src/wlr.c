@@ -0,0 +1,585 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <poll.h>
+#include <gtk/gtk.h>
+#include <wayland-client.h>
+#include "wlr-output-management-unstable-v1-client-protocol.h"
+#include "raindrop.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    struct zwlr_output_mode_v1 *mode;
+    int width;
+    int height;
+    int refresh;
+} wlr_mode_t;
+
+typedef struct {
+    struct zwlr_output_head_v1 *head;
+    char *name;
+    gboolean enabled;
+    gboolean finished;
+    int x;
+    int y;
+    int transform;
+    double scale;
+    wlr_mode_t *current;
+    GList *modes;
+} wlr_head_t;
+
+typedef struct {
+    struct wl_display *display;
+    struct wl_registry *registry;
+    struct zwlr_output_manager_v1 *manager;
+    GList *heads;
+    guint32 serial;
+    gboolean done;
+} wlr_conn_t;
+
+typedef enum {
+    CONF_PENDING,
+    CONF_SUCCEEDED,
+    CONF_FAILED,
+    CONF_CANCELLED
+} conf_result_t;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static void mode_size (void *data, struct zwlr_output_mode_v1 *, int32_t width, int32_t height);
+static void mode_refresh (void *data, struct zwlr_output_mode_v1 *, int32_t refresh);
+static void mode_preferred (void *, struct zwlr_output_mode_v1 *);
+static void mode_finished (void *, struct zwlr_output_mode_v1 *);
+static void head_name (void *data, struct zwlr_output_head_v1 *, const char *name);
+static void head_description (void *, struct zwlr_output_head_v1 *, const char *);
+static void head_physical_size (void *, struct zwlr_output_head_v1 *, int32_t, int32_t);
+static void head_mode (void *data, struct zwlr_output_head_v1 *, struct zwlr_output_mode_v1 *wmode);
+static void head_enabled (void *data, struct zwlr_output_head_v1 *, int32_t enabled);
+static void head_current_mode (void *data, struct zwlr_output_head_v1 *, struct zwlr_output_mode_v1 *wmode);
+static void head_position (void *data, struct zwlr_output_head_v1 *, int32_t x, int32_t y);
+static void head_transform (void *data, struct zwlr_output_head_v1 *, int32_t transform);
+static void head_scale (void *data, struct zwlr_output_head_v1 *, wl_fixed_t scale);
+static void head_finished (void *data, struct zwlr_output_head_v1 *);
+static void head_make (void *, struct zwlr_output_head_v1 *, const char *);
+static void head_model (void *, struct zwlr_output_head_v1 *, const char *);
+static void head_serial_number (void *, struct zwlr_output_head_v1 *, const char *);
+static void head_adaptive_sync (void *, struct zwlr_output_head_v1 *, uint32_t);
+static void manager_head (void *data, struct zwlr_output_manager_v1 *, struct zwlr_output_head_v1 *whead);
+static void manager_done (void *data, struct zwlr_output_manager_v1 *, uint32_t serial);
+static void manager_finished (void *, struct zwlr_output_manager_v1 *);
+static void registry_global (void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t);
+static void registry_global_remove (void *, struct wl_registry *, uint32_t);
+static void config_succeeded (void *data, struct zwlr_output_configuration_v1 *);
+static void config_failed (void *data, struct zwlr_output_configuration_v1 *);
+static void config_cancelled (void *data, struct zwlr_output_configuration_v1 *);
+static gboolean wlr_connect (wlr_conn_t *conn);
+static void wlr_disconnect (wlr_conn_t *conn);
+static wlr_mode_t *find_mode (wlr_head_t *head, int width, int height, float freq);
+static conf_result_t send_config (wlr_conn_t *conn, gboolean test);
+wlr_result_t wlr_apply_config (void);
+static gboolean heads_match (wlr_conn_t *conn, monitor_t *expected);
+static gboolean wait_for_done (wlr_conn_t *conn, gint64 deadline);
+wlr_result_t wlr_wait_for_config (monitor_t *expected, int timeout);
+
+/*----------------------------------------------------------------------------*/
+/* Mode events */
+/*----------------------------------------------------------------------------*/
+
+static void mode_size (void *data, struct zwlr_output_mode_v1 *, int32_t width, int32_t height)
+{
+    wlr_mode_t *mode = (wlr_mode_t *) data;
+    mode->width = width;
+    mode->height = height;
+}
+
+static void mode_refresh (void *data, struct zwlr_output_mode_v1 *, int32_t refresh)
+{
+    wlr_mode_t *mode = (wlr_mode_t *) data;
+    mode->refresh = refresh;
+}
+
+static void mode_preferred (void *, struct zwlr_output_mode_v1 *) {}
+
+static void mode_finished (void *, struct zwlr_output_mode_v1 *) {}
+
+static const struct zwlr_output_mode_v1_listener mode_listener = {
+    .size = mode_size,
+    .refresh = mode_refresh,
+    .preferred = mode_preferred,
+    .finished = mode_finished
+};
+
+/*----------------------------------------------------------------------------*/
+/* Head events */
+/*----------------------------------------------------------------------------*/
+
+static void head_name (void *data, struct zwlr_output_head_v1 *, const char *name)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    g_free (head->name);
+    head->name = g_strdup (name);
+}
+
+static void head_description (void *, struct zwlr_output_head_v1 *, const char *) {}
+
+static void head_physical_size (void *, struct zwlr_output_head_v1 *, int32_t, int32_t) {}
+
+static void head_mode (void *data, struct zwlr_output_head_v1 *, struct zwlr_output_mode_v1 *wmode)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    wlr_mode_t *mode;
+
+    mode = g_new0 (wlr_mode_t, 1);
+    mode->mode = wmode;
+    zwlr_output_mode_v1_add_listener (wmode, &mode_listener, mode);
+    head->modes = g_list_append (head->modes, mode);
+}
+
+static void head_enabled (void *data, struct zwlr_output_head_v1 *, int32_t enabled)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->enabled = enabled ? TRUE : FALSE;
+}
+
+static void head_current_mode (void *data, struct zwlr_output_head_v1 *, struct zwlr_output_mode_v1 *wmode)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->current = (wlr_mode_t *) zwlr_output_mode_v1_get_user_data (wmode);
+}
+
+static void head_position (void *data, struct zwlr_output_head_v1 *, int32_t x, int32_t y)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->x = x;
+    head->y = y;
+}
+
+static void head_transform (void *data, struct zwlr_output_head_v1 *, int32_t transform)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->transform = transform;
+}
+
+static void head_scale (void *data, struct zwlr_output_head_v1 *, wl_fixed_t scale)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->scale = wl_fixed_to_double (scale);
+}
+
+static void head_finished (void *data, struct zwlr_output_head_v1 *)
+{
+    wlr_head_t *head = (wlr_head_t *) data;
+    head->finished = TRUE;
+}
+
+static void head_make (void *, struct zwlr_output_head_v1 *, const char *) {}
+
+static void head_model (void *, struct zwlr_output_head_v1 *, const char *) {}
+
+static void head_serial_number (void *, struct zwlr_output_head_v1 *, const char *) {}
+
+static void head_adaptive_sync (void *, struct zwlr_output_head_v1 *, uint32_t) {}
+
+static const struct zwlr_output_head_v1_listener head_listener = {
+    .name = head_name,
+    .description = head_description,
+    .physical_size = head_physical_size,
+    .mode = head_mode,
+    .enabled = head_enabled,
+    .current_mode = head_current_mode,
+    .position = head_position,
+    .transform = head_transform,
+    .scale = head_scale,
+    .finished = head_finished,
+    .make = head_make,
+    .model = head_model,
+    .serial_number = head_serial_number,
+    .adaptive_sync = head_adaptive_sync
+};
+
+/*----------------------------------------------------------------------------*/
+/* Manager and registry events */
+/*----------------------------------------------------------------------------*/
+
+static void manager_head (void *data, struct zwlr_output_manager_v1 *, struct zwlr_output_head_v1 *whead)
+{
+    wlr_conn_t *conn = (wlr_conn_t *) data;
+    wlr_head_t *head;
+
+    head = g_new0 (wlr_head_t, 1);
+    head->head = whead;
+    head->scale = 1.0;
+    zwlr_output_head_v1_add_listener (whead, &head_listener, head);
+    conn->heads = g_list_append (conn->heads, head);
+}
+
+static void manager_done (void *data, struct zwlr_output_manager_v1 *, uint32_t serial)
+{
+    wlr_conn_t *conn = (wlr_conn_t *) data;
+    conn->serial = serial;
+    conn->done = TRUE;
+}
+
+static void manager_finished (void *, struct zwlr_output_manager_v1 *) {}
+
+static const struct zwlr_output_manager_v1_listener manager_listener = {
+    .head = manager_head,
+    .done = manager_done,
+    .finished = manager_finished
+};
+
+static void registry_global (void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t)
+{
+    wlr_conn_t *conn = (wlr_conn_t *) data;
+
+    if (!g_strcmp0 (interface, zwlr_output_manager_v1_interface.name))
+    {
+        conn->manager = wl_registry_bind (registry, name, &zwlr_output_manager_v1_interface, 1);
+        zwlr_output_manager_v1_add_listener (conn->manager, &manager_listener, conn);
+    }
+}
+
+static void registry_global_remove (void *, struct wl_registry *, uint32_t) {}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove
+};
+
+/*----------------------------------------------------------------------------*/
+/* Configuration events */
+/*----------------------------------------------------------------------------*/
+
+static void config_succeeded (void *data, struct zwlr_output_configuration_v1 *)
+{
+    *((conf_result_t *) data) = CONF_SUCCEEDED;
+}
+
+static void config_failed (void *data, struct zwlr_output_configuration_v1 *)
+{
+    *((conf_result_t *) data) = CONF_FAILED;
+}
+
+static void config_cancelled (void *data, struct zwlr_output_configuration_v1 *)
+{
+    *((conf_result_t *) data) = CONF_CANCELLED;
+}
+
+static const struct zwlr_output_configuration_v1_listener config_listener = {
+    .succeeded = config_succeeded,
+    .failed = config_failed,
+    .cancelled = config_cancelled
+};
+
+/*----------------------------------------------------------------------------*/
+/* Connection */
+/*----------------------------------------------------------------------------*/
+
+static gboolean wlr_connect (wlr_conn_t *conn)
+{
+    conn->display = wl_display_connect (NULL);
+    if (!conn->display) return FALSE;
+
+    conn->registry = wl_display_get_registry (conn->display);
+    wl_registry_add_listener (conn->registry, &registry_listener, conn);
+    wl_display_roundtrip (conn->display);
+    if (!conn->manager) return FALSE;
+
+    // the current heads and modes are sent on bind, terminated by a done event
+    while (!conn->done)
+        if (wl_display_dispatch (conn->display) == -1) return FALSE;
+
+    return TRUE;
+}
+
+static void wlr_disconnect (wlr_conn_t *conn)
+{
+    GList *hptr, *mptr;
+    wlr_head_t *head;
+    wlr_mode_t *mode;
+
+    for (hptr = conn->heads; hptr; hptr = hptr->next)
+    {
+        head = (wlr_head_t *) hptr->data;
+        for (mptr = head->modes; mptr; mptr = mptr->next)
+        {
+            mode = (wlr_mode_t *) mptr->data;
+            zwlr_output_mode_v1_destroy (mode->mode);
+            g_free (mode);
+        }
+        g_list_free (head->modes);
+        zwlr_output_head_v1_destroy (head->head);
+        g_free (head->name);
+        g_free (head);
+    }
+    g_list_free (conn->heads);
+    conn->heads = NULL;
+
+    if (conn->manager) zwlr_output_manager_v1_destroy (conn->manager);
+    if (conn->registry) wl_registry_destroy (conn->registry);
+    if (conn->display) wl_display_disconnect (conn->display);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Applying config */
+/*----------------------------------------------------------------------------*/
+
+static wlr_mode_t *find_mode (wlr_head_t *head, int width, int height, float freq)
+{
+    GList *mptr;
+    wlr_mode_t *mode, *best = NULL;
+    int refresh = freq * 1000.0 + 0.5;
+    int diff, bdiff = 0;
+
+    for (mptr = head->modes; mptr; mptr = mptr->next)
+    {
+        mode = (wlr_mode_t *) mptr->data;
+        if (mode->width != width || mode->height != height) continue;
+        diff = ABS (mode->refresh - refresh);
+        if (best == NULL || diff < bdiff)
+        {
+            best = mode;
+            bdiff = diff;
+        }
+    }
+
+    // anything more than a rounding error away needs to be a custom mode
+    if (best && bdiff > 10) return NULL;
+    return best;
+}
+
+static conf_result_t send_config (wlr_conn_t *conn, gboolean test)
+{
+    struct zwlr_output_configuration_v1 *config;
+    struct zwlr_output_configuration_head_v1 *chead;
+    GList *hptr, *cheads = NULL;
+    wlr_head_t *head;
+    wlr_mode_t *mode;
+    conf_result_t res = CONF_PENDING;
+    int m;
+
+    config = zwlr_output_manager_v1_create_configuration (conn->manager, conn->serial);
+    zwlr_output_configuration_v1_add_listener (config, &config_listener, &res);
+
+    // every head must be either enabled or disabled in a configuration
+    for (hptr = conn->heads; hptr; hptr = hptr->next)
+    {
+        head = (wlr_head_t *) hptr->data;
+        if (head->finished) continue;
+
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            if (!g_strcmp0 (mons[m].name, head->name)) break;
+        }
+
+        if (m == MAX_MONS)
+        {
+            // not a monitor we know about - leave it as it is
+            if (!head->enabled)
+            {
+                zwlr_output_configuration_v1_disable_head (config, head->head);
+                continue;
+            }
+            chead = zwlr_output_configuration_v1_enable_head (config, head->head);
+            if (head->current) zwlr_output_configuration_head_v1_set_mode (chead, head->current->mode);
+            zwlr_output_configuration_head_v1_set_position (chead, head->x, head->y);
+            zwlr_output_configuration_head_v1_set_transform (chead, head->transform);
+            zwlr_output_configuration_head_v1_set_scale (chead, wl_fixed_from_double (head->scale));
+        }
+        else if (!mons[m].enabled)
+        {
+            zwlr_output_configuration_v1_disable_head (config, head->head);
+            continue;
+        }
+        else
+        {
+            chead = zwlr_output_configuration_v1_enable_head (config, head->head);
+            mode = find_mode (head, mons[m].width, mons[m].height, mons[m].freq);
+            if (mode) zwlr_output_configuration_head_v1_set_mode (chead, mode->mode);
+            else zwlr_output_configuration_head_v1_set_custom_mode (chead, mons[m].width, mons[m].height,
+                mons[m].freq * 1000.0 + 0.5);
+            zwlr_output_configuration_head_v1_set_position (chead, mons[m].x, mons[m].y);
+            zwlr_output_configuration_head_v1_set_transform (chead, mons[m].rotation / 90);
+            zwlr_output_configuration_head_v1_set_scale (chead, wl_fixed_from_double (mons[m].scale));
+        }
+        cheads = g_list_append (cheads, chead);
+    }
+
+    if (test) zwlr_output_configuration_v1_test (config);
+    else zwlr_output_configuration_v1_apply (config);
+
+    while (res == CONF_PENDING)
+    {
+        if (wl_display_dispatch (conn->display) == -1)
+        {
+            res = CONF_FAILED;
+            break;
+        }
+    }
+
+    for (hptr = cheads; hptr; hptr = hptr->next)
+        zwlr_output_configuration_head_v1_destroy ((struct zwlr_output_configuration_head_v1 *) hptr->data);
+    g_list_free (cheads);
+    zwlr_output_configuration_v1_destroy (config);
+
+    return res;
+}
+
+wlr_result_t wlr_apply_config (void)
+{
+    wlr_conn_t conn;
+    conf_result_t res = CONF_FAILED;
+    int tries;
+
+    memset (&conn, 0, sizeof (wlr_conn_t));
+    if (!wlr_connect (&conn))
+    {
+        wlr_disconnect (&conn);
+        return WLR_UNAVAILABLE;
+    }
+
+    for (tries = 0; tries < 3; tries++)
+    {
+        // validate the whole layout before touching the screens
+        res = send_config (&conn, TRUE);
+        if (res == CONF_SUCCEEDED) res = send_config (&conn, FALSE);
+        if (res != CONF_CANCELLED) break;
+
+        // outputs changed under us - pick up the new state and serial and try again
+        if (wl_display_roundtrip (conn.display) == -1) break;
+    }
+
+    wlr_disconnect (&conn);
+    return res == CONF_SUCCEEDED ? WLR_APPLIED : WLR_FAILED;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Waiting for config */
+/*----------------------------------------------------------------------------*/
+
+static gboolean heads_match (wlr_conn_t *conn, monitor_t *expected)
+{
+    GList *hptr;
+    wlr_head_t *head;
+    int m;
+
+    for (hptr = conn->heads; hptr; hptr = hptr->next)
+    {
+        head = (wlr_head_t *) hptr->data;
+        if (head->finished) continue;
+
+        for (m = 0; m < MAX_MONS; m++)
+        {
+            if (mons[m].modes == NULL) continue;
+            if (!g_strcmp0 (mons[m].name, head->name)) break;
+        }
+        if (m == MAX_MONS) continue;
+
+        if (head->enabled != expected[m].enabled) return FALSE;
+        if (!head->enabled) continue;
+        // a custom mode need not be sent as a mode object, and the head reports its size
+        // and refresh nowhere else, so then only the rest of the layout can be checked
+        if (head->current)
+        {
+            if (head->current->width != expected[m].width || head->current->height != expected[m].height) return FALSE;
+            // custom modes have no refresh rate of their own to compare against
+            if (expected[m].freq != 0.0 && ABS (head->current->refresh - (int) (expected[m].freq * 1000.0 + 0.5)) > 10) return FALSE;
+        }
+        if (head->x != expected[m].x || head->y != expected[m].y) return FALSE;
+        if (head->transform != expected[m].rotation / 90) return FALSE;
+        if (ABS (head->scale - expected[m].scale) > 0.01) return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean wait_for_done (wlr_conn_t *conn, gint64 deadline)
+{
+    struct pollfd pfd;
+    int wait;
+
+    pfd.fd = wl_display_get_fd (conn->display);
+    pfd.events = POLLIN;
+
+    conn->done = FALSE;
+    while (!conn->done)
+    {
+        wait = (deadline - g_get_monotonic_time ()) / 1000;
+        if (wait <= 0) return FALSE;
+
+        while (wl_display_prepare_read (conn->display) != 0)
+            wl_display_dispatch_pending (conn->display);
+        if (conn->done)
+        {
+            wl_display_cancel_read (conn->display);
+            break;
+        }
+        wl_display_flush (conn->display);
+
+        if (poll (&pfd, 1, wait) <= 0)
+        {
+            wl_display_cancel_read (conn->display);
+            return FALSE;
+        }
+        if (wl_display_read_events (conn->display) == -1) return FALSE;
+        wl_display_dispatch_pending (conn->display);
+    }
+    return TRUE;
+}
+
+wlr_result_t wlr_wait_for_config (monitor_t *expected, int timeout)
+{
+    wlr_conn_t conn;
+    gint64 deadline;
+    gboolean res;
+
+    deadline = g_get_monotonic_time () + timeout * 1000;
+
+    memset (&conn, 0, sizeof (wlr_conn_t));
+    if (!wlr_connect (&conn))
+    {
+        // no way to check - not the same as the settings not taking effect
+        wlr_disconnect (&conn);
+        return WLR_UNAVAILABLE;
+    }
+
+    // the compositor sends a done event after every change to the outputs, so
+    // check the state as each one arrives rather than polling for it
+    while (!(res = heads_match (&conn, expected)))
+        if (!wait_for_done (&conn, deadline)) break;
+
+    wlr_disconnect (&conn);
+    return res ? WLR_APPLIED : WLR_FAILED;
+}
+
+/* End of file */
+/*============================================================================*/